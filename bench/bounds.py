@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Measure the running time overhead of -fbounds-check.
+
+Compiles data/bsort.pcl, data/primes.pcl and a bubble sort over an array allocated with new [n] with and
+without -fbounds-check at every optimization level, checks that both print the same and reports the median
+running time of each along with the overhead of the checks.
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+# Sorts the array in reverse order, so that every comparison of the inner loop swaps
+HEAP_SORT = """program heap_bsort;
+var p : ^array of integer;
+    n, i, j, t : integer;
+    changed : boolean;
+begin
+  n := %d;
+  new [n] p;
+  i := 0;
+  while i < n do
+  begin
+    p^[i] := n - i;
+    i := i + 1
+  end;
+  changed := true;
+  j := n - 1;
+  while changed do
+  begin
+    changed := false;
+    i := 0;
+    while i < j do
+    begin
+      if p^[i] > p^[i+1] then
+      begin
+        t := p^[i];
+        p^[i] := p^[i+1];
+        p^[i+1] := t;
+        changed := true
+      end;
+      i := i + 1
+    end;
+    j := j - 1
+  end;
+  writeInteger(p^[0]);
+  writeString("\\n");
+  dispose [] p
+end.
+"""
+
+
+def build(args, source, level, checks, exe):
+    command = [args.pcl, "-O%d" % level, "-o", exe, source] + (["-fbounds-check"] if checks else [])
+    result = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    if result.returncode != 0:
+        sys.exit("%s failed:\n%s" % (" ".join(command), result.stderr))
+
+
+# Median wall clock time of the runs in milliseconds and the output of the program
+def run(exe, stdin, repeat):
+    times, output = [], None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        output = subprocess.run([exe], input=stdin, stdout=subprocess.PIPE, check=True).stdout
+        times.append((time.perf_counter() - start) * 1000)
+
+    return statistics.median(times), output
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    data = os.path.join(here, "..", "data")
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--pcl", default=os.path.join(here, "..", "src", "pcl"), help="compiler to measure")
+    parser.add_argument("--levels", default="0,2", help="comma separated optimization levels (default 0,2)")
+    parser.add_argument("--limit", type=int, default=200000, help="upper limit given to primes.pcl")
+    parser.add_argument("--size", type=int, default=20000, help="elements of the bubble sort over new [n]")
+    parser.add_argument("--repeat", type=int, default=11, help="runs of every program, the median is kept")
+    args = parser.parse_args()
+
+    levels = [int(level) for level in args.levels.split(",")]
+
+    print("%-16s %6s %14s %14s %10s" % ("program", "level", "plain (ms)", "checked (ms)", "overhead"))
+
+    with tempfile.TemporaryDirectory(prefix="pcl-bounds-") as tmp:
+        heap_sort = os.path.join(tmp, "heap_bsort.pcl")
+        with open(heap_sort, "w") as f:
+            f.write(HEAP_SORT % args.size)
+
+        programs = [(os.path.join(data, "bsort.pcl"), b""),
+                    (os.path.join(data, "primes.pcl"), b"%d\n" % args.limit),
+                    (heap_sort, b"")]
+
+        for source, stdin in programs:
+            name = os.path.splitext(os.path.basename(source))[0]
+
+            for level in levels:
+                times, outputs = [], []
+                for checks in [False, True]:
+                    exe = os.path.join(tmp, "%s_O%d_%s" % (name, level, "checked" if checks else "plain"))
+                    build(args, source, level, checks, exe)
+
+                    elapsed, output = run(exe, stdin, args.repeat)
+                    times.append(elapsed)
+                    outputs.append(output)
+
+                if outputs[0] != outputs[1]:
+                    sys.exit("The checks change the output of %s at -O%d" % (name, level))
+
+                print("%-16s %6s %14.1f %14.1f %9.1f%%" % (name, "-O%d" % level, times[0], times[1],
+                                                           (times[1] / times[0] - 1) * 100))
+
+
+if __name__ == "__main__":
+    main()
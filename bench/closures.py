@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""Compare the closure strategies of pcl on deeply nested programs.
+
+Generates programs with gen_program.py whose functions are chains of nested functions of growing depth
+that read and write the variables of every enclosing scope, compiles each with --closures=chain and
+--closures=display at every optimization level, checks that both print the same and reports the
+best running time of each along with the size of the generated code.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+import gen_program
+
+DEPTHS = [2, 4, 8, 16, 32]
+STRATEGIES = ["chain", "display"]
+
+
+def build(args, source, level, strategy, exe):
+    command = [args.pcl, "-O%d" % level, "--closures=" + strategy, "-o", exe, source]
+    result = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    if result.returncode != 0:
+        sys.exit("%s failed:\n%s" % (" ".join(command), result.stderr))
+
+
+# Best wall clock time of the runs in milliseconds and the output of the program
+def run(exe, repeat):
+    best, output = None, None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        output = subprocess.run([exe], stdout=subprocess.PIPE, check=True).stdout
+        elapsed = (time.perf_counter() - start) * 1000
+        best = elapsed if best is None else min(best, elapsed)
+
+    return best, output
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--pcl", default=os.path.join(here, "..", "src", "pcl"), help="compiler to measure")
+    parser.add_argument("--depths", default=",".join(map(str, DEPTHS)), help="comma separated nesting depths")
+    parser.add_argument("--levels", default="0,2", help="comma separated optimization levels (default 0,2)")
+    parser.add_argument("--calls", type=int, default=200000, help="calls of the outermost function by main")
+    parser.add_argument("--vars", type=int, default=4, help="variables declared in every scope")
+    parser.add_argument("--stmts", type=int, default=6, help="statements in the body of every function")
+    parser.add_argument("--repeat", type=int, default=3, help="runs of every program, the fastest is kept")
+    args = parser.parse_args()
+
+    levels = [int(level) for level in args.levels.split(",")]
+    depths = [int(depth) for depth in args.depths.split(",")]
+
+    print("%6s %6s" % ("depth", "level") + "".join("%14s" % ("%s (ms)" % s) for s in STRATEGIES) +
+          "%10s" % "speedup" + "".join("%14s" % ("%s (B)" % s) for s in STRATEGIES))
+
+    with tempfile.TemporaryDirectory(prefix="pcl-closures-") as tmp:
+        for depth in depths:
+            gen_args = gen_program.parse_args(["--functions=1", "--depth=%d" % depth, "--vars=%d" % args.vars,
+                                               "--stmts=%d" % args.stmts, "--expr-depth=2",
+                                               "--calls=%d" % args.calls])
+            source = os.path.join(tmp, "nested_%d.pcl" % depth)
+            with open(source, "w") as f:
+                f.write(gen_program.generate(gen_args))
+
+            for level in levels:
+                times, sizes, outputs = [], [], []
+                for strategy in STRATEGIES:
+                    exe = os.path.join(tmp, "nested_%d_O%d_%s" % (depth, level, strategy))
+                    build(args, source, level, strategy, exe)
+
+                    elapsed, output = run(exe, args.repeat)
+                    times.append(elapsed)
+                    sizes.append(os.path.getsize(exe))
+                    outputs.append(output)
+
+                if outputs[0] != outputs[1]:
+                    sys.exit("The strategies disagree on the output of depth %d at -O%d" % (depth, level))
+
+                print("%6d %6s" % (depth, "-O%d" % level) + "".join("%14.1f" % t for t in times) +
+                      "%9.2fx" % (times[0] / times[1]) + "".join("%14d" % size for size in sizes))
+
+
+if __name__ == "__main__":
+    main()
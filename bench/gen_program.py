@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""Generate synthetic PCL programs of a given shape for compile time benchmarks.
+
+The program has --functions top level functions. Each of them is the outermost of a chain of
+--depth nested functions and every function in the chain declares --vars integer variables and
+runs --stmts statements whose expressions are trees of depth --expr-depth over the variables
+of its own scope, the variables of all enclosing scopes and the variables of the program.
+Every function calls the function nested in it and the previous top level function, so the
+static links of every level are built, and main prints the result of every top level function.
+With --calls main also calls every top level function that many times in a loop, which gives the
+programs a running time for comparing the code generated for them.
+The output only depends on the arguments so the same program can be regenerated at any time.
+"""
+
+import argparse
+import random
+import sys
+
+
+class Generator:
+    def __init__(self, args):
+        self.args = args
+        self.rand = random.Random(args.seed)
+        self.out = []
+
+    def emit(self, indent, line):
+        self.out.append("  " * indent + line)
+
+    def leaf(self, names):
+        if self.rand.random() < 0.25:
+            return str(self.rand.randint(1, 9))
+        return self.rand.choice(names)
+
+    def expr(self, names, depth):
+        if depth == 0:
+            return self.leaf(names)
+        op = self.rand.choice(["+", "-", "*", "+"])
+        left = self.expr(names, depth - 1)
+        right = self.expr(names, depth - 1)
+        return "(%s %s %s)" % (left, op, right)
+
+    def cond(self, names):
+        depth = max(0, self.args.expr_depth - 1)
+        op = self.rand.choice(["<", "<=", ">", ">=", "=", "<>"])
+        return "%s %s %s" % (self.expr(names, depth), op, self.expr(names, depth))
+
+    # Assignments to the variables of any visible scope, with some bounded loops and conditionals
+    def stmts(self, names, counter):
+        lines = []
+        for i in range(self.args.stmts):
+            target = self.rand.choice(names)
+            kind = self.rand.random()
+            if kind < 0.15:
+                lines.append("if %s then %s := %s else %s := %s" % (
+                    self.cond(names), target, self.expr(names, self.args.expr_depth),
+                    target, self.expr(names, self.args.expr_depth)))
+            elif kind < 0.25:
+                lines.append("%s := 0;" % counter)
+                lines.append("while %s < 4 do begin %s := %s; %s := %s + 1 end" % (
+                    counter, target, self.expr(names, self.args.expr_depth), counter, counter))
+            else:
+                lines.append("%s := %s" % (target, self.expr(names, self.args.expr_depth)))
+        return lines
+
+    def function(self, top, level, indent, outer):
+        name = "f%d_%d" % (top, level)
+        own = ["v%d_%d_%d" % (top, level, i) for i in range(self.args.vars)]
+        counter = "c%d_%d" % (top, level)
+        names = outer + own + ["n"]
+
+        self.emit(indent, "function %s (n : integer) : integer;" % name)
+        decl = ", ".join(own + [counter])
+        self.emit(indent + 1, "var %s : integer;" % decl)
+        if level + 1 < self.args.depth:
+            # The nested function doesn't see n of this level, it has its own
+            self.function(top, level + 1, indent + 1, outer + own)
+
+        body = ["%s := n + %d" % (v, i) for i, v in enumerate(own)]
+        body += self.stmts(names, counter)
+        result = "n"
+        if level + 1 < self.args.depth:
+            result += " + f%d_%d(n + 1)" % (top, level + 1)
+        if level == 0 and top > 0:
+            result += " + f%d_0(n)" % (top - 1)
+        if own:
+            result += " + " + own[-1]
+        body.append("result := " + result)
+
+        self.emit(indent, "begin")
+        for i, line in enumerate(body):
+            self.emit(indent + 1, line + (";" if i + 1 < len(body) else ""))
+        self.emit(indent, "end;")
+        if level == 0:
+            self.emit(0, "")
+
+    def program(self):
+        globals_ = ["g%d" % i for i in range(self.args.vars)]
+
+        self.emit(0, "program synthetic;")
+        self.emit(0, "")
+        declared = globals_ + (["iter", "total"] if self.args.calls > 0 else [])
+        if declared:
+            self.emit(0, "var %s : integer;" % ", ".join(declared))
+            self.emit(0, "")
+
+        for top in range(self.args.functions):
+            self.function(top, 0, 0, globals_)
+
+        body = ["%s := %d" % (g, i) for i, g in enumerate(globals_)]
+        for top in range(self.args.functions):
+            body.append("writeInteger(f%d_0(%d))" % (top, top))
+            body.append('writeString("\\n")')
+
+        if self.args.calls > 0:
+            sum_ = " + ".join("f%d_0(iter)" % top for top in range(self.args.functions))
+            body.append("iter := 0")
+            body.append("total := 0")
+            body.append("while iter < %d do begin total := total + %s; iter := iter + 1 end" % (self.args.calls, sum_))
+            body.append("writeInteger(total)")
+            body.append('writeString("\\n")')
+
+        self.emit(0, "begin")
+        for i, line in enumerate(body):
+            self.emit(1, line + (";" if i + 1 < len(body) else ""))
+        self.emit(0, "end.")
+
+        return "\n".join(self.out) + "\n"
+
+
+def parse_args(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--functions", type=int, default=10, help="number of top level functions")
+    parser.add_argument("--depth", type=int, default=2, help="nesting depth of every top level function")
+    parser.add_argument("--vars", type=int, default=5, help="integer variables declared in every scope")
+    parser.add_argument("--stmts", type=int, default=10, help="statements in the body of every function")
+    parser.add_argument("--expr-depth", type=int, default=3, help="depth of the expression trees")
+    parser.add_argument("--calls", type=int, default=0, help="calls of every top level function in a loop of main")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the random choices")
+    parser.add_argument("-o", "--output", help="output file (standard output by default)")
+    args = parser.parse_args(argv)
+
+    if (args.functions < 1 or args.depth < 1 or args.vars < 0 or args.stmts < 0 or args.expr_depth < 0 or
+            args.calls < 0):
+        parser.error("--functions and --depth must be positive and the other sizes not negative")
+
+    return args
+
+
+def generate(args):
+    return Generator(args).program()
+
+
+def main():
+    args = parse_args()
+    source = generate(args)
+
+    if args.output:
+        with open(args.output, "w") as out:
+            out.write(source)
+    else:
+        sys.stdout.write(source)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Measure the running time of the programs in data at every optimization level.
+
+Compiles each program of the optimization levels table of the README at -O0 to -O3, runs it a number of
+times with its output sent to /dev/null and reports the median running time of each level, +- half the
+difference between the slowest and the fastest run in percent of the median.
+"""
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+# The programs of the table and what they read
+PROGRAMS = {
+    "bsort": b"",
+    "hanoi": b"20\n",
+    "mandelbrot": b"",
+    "mean": b"101\n100000000\n",
+    "new_dispose": b"",
+    "primes": b"100000\n",
+    "reverse": b"",
+}
+
+
+def build(args, source, level, exe):
+    command = [args.pcl, "-O%d" % level, "-o", exe, source]
+    result = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    if result.returncode != 0:
+        sys.exit("%s failed:\n%s" % (" ".join(command), result.stderr))
+
+
+# Median wall clock time of the runs in milliseconds and the difference between the slowest and the fastest
+# run in percent of it
+def run(exe, stdin, repeat):
+    times = []
+    for _ in range(repeat):
+        start = time.perf_counter()
+        subprocess.run([exe], input=stdin, stdout=subprocess.DEVNULL, check=True)
+        times.append((time.perf_counter() - start) * 1000)
+
+    median = statistics.median(times)
+    return median, (max(times) - min(times)) / median * 100 if median else 0.0
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    data = os.path.join(here, "..", "data")
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--pcl", default=os.path.join(here, "..", "src", "pcl"), help="compiler to measure")
+    parser.add_argument("--levels", default="0,1,2,3", help="comma separated optimization levels (default 0,1,2,3)")
+    parser.add_argument("--programs", default=",".join(PROGRAMS), help="comma separated programs of data")
+    parser.add_argument("--repeat", type=int, default=11, help="runs of every program, the median is kept")
+    args = parser.parse_args()
+
+    levels = [int(level) for level in args.levels.split(",")]
+    programs = args.programs.split(",")
+
+    print("%-12s" % "program" + "".join("%18s" % ("-O%d (ms)" % level) for level in levels))
+
+    with tempfile.TemporaryDirectory(prefix="pcl-levels-") as tmp:
+        for name in programs:
+            if name not in PROGRAMS:
+                sys.exit("Unknown program %s" % name)
+
+            row = "%-12s" % name
+            for level in levels:
+                exe = os.path.join(tmp, "%s_O%d" % (name, level))
+                build(args, os.path.join(data, name + ".pcl"), level, exe)
+
+                median, spread = run(exe, PROGRAMS[name], args.repeat)
+                row += "%18s" % ("%.1f +-%.0f%%" % (median, spread / 2))
+
+            print(row)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""Measure how the compile time and memory of pcl grow with the size of the input program.
+
+Every sweep grows one dimension of the programs made by gen_program.py while the others keep
+their base value, compiles each program at every optimization level with --time-report-json
+and prints the time of every phase. The last column of each sweep is the growth exponent k of
+the total time t ~ size^k, where size is the length of the source, fitted over the sweep.
+Phases that grow with k clearly above 1 scale super-linearly and are listed at the end.
+"""
+
+import argparse
+import csv
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+import gen_program
+
+BASE = {"functions": 10, "depth": 2, "vars": 5, "stmts": 10, "expr_depth": 3}
+
+SWEEPS = {
+    "functions": [10, 20, 40, 80, 160, 320],
+    "depth": [2, 4, 8, 16, 32, 64],
+    "vars": [5, 10, 20, 40, 80, 160],
+    "stmts": [10, 20, 40, 80, 160, 320],
+    "expr_depth": [2, 3, 4, 5, 6, 7],
+}
+
+# Phases of the report shown in the tables, in the order they run
+PHASES = ["Lex and parse", "Semantic analysis", "Constant folding", "IR generation", "Verification", "Inlining", "Optimization", "Code emission"]
+SHORT = ["parse", "sema", "fold", "irgen", "verify", "inline", "opt", "emit"]
+
+# Exponent above which a phase is reported as super-linear
+SUPER_LINEAR = 1.3
+
+
+def compile_program(pcl, path, level, report):
+    command = [pcl, "-O%d" % level, "-c", "--no-imm", "--time-report-json", report, path]
+    result = subprocess.run(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, universal_newlines=True)
+    if result.returncode != 0:
+        sys.exit("%s failed:\n%s" % (" ".join(command), result.stderr))
+
+    with open(report) as f:
+        data = json.load(f)
+
+    times = {phase["name"]: phase["wall_us"] / 1000.0 for phase in data["phases"]}
+    return times, data["peak_rss_kb"]
+
+
+# Least squares slope of log(y) over log(x), ignoring times too small to be measured
+def exponent(xs, ys):
+    points = [(math.log(x), math.log(y)) for x, y in zip(xs, ys) if y >= 0.5]
+    if len(points) < 3:
+        return None
+
+    mx = sum(p[0] for p in points) / len(points)
+    my = sum(p[1] for p in points) / len(points)
+    num = sum((p[0] - mx) * (p[1] - my) for p in points)
+    den = sum((p[0] - mx) ** 2 for p in points)
+    return num / den if den else None
+
+
+def format_exponent(k):
+    return "   -" if k is None else "%4.2f" % k
+
+
+def run_sweep(args, dimension, values, level, tmp, rows):
+    print()
+    print("%s at -O%d" % (dimension, level))
+    print("%10s %10s" % (dimension, "bytes") + "".join("%10s" % s for s in SHORT) + "%10s %10s" % ("total", "rss (KB)"))
+
+    sizes, totals, per_phase = [], [], {phase: [] for phase in PHASES}
+    for value in values:
+        shape = dict(BASE)
+        shape[dimension] = value
+        gen_args = gen_program.parse_args(["--%s=%d" % (k.replace("_", "-"), v) for k, v in shape.items()] +
+                                          ["--seed=%d" % args.seed])
+        source = gen_program.generate(gen_args)
+
+        path = os.path.join(tmp, "%s_%d.pcl" % (dimension, value))
+        with open(path, "w") as f:
+            f.write(source)
+
+        # Best of the repetitions, the peak memory doesn't change between them
+        best = None
+        for _ in range(args.repeat):
+            times, rss = compile_program(args.pcl, path, level, os.path.join(tmp, "report.json"))
+            total = sum(times.values())
+            if best is None or total < best[0]:
+                best = (total, times, rss)
+
+        total, times, rss = best
+        sizes.append(len(source))
+        totals.append(total)
+        for phase in PHASES:
+            per_phase[phase].append(times.get(phase, 0.0))
+
+        print("%10d %10d" % (value, len(source)) + "".join("%10.1f" % times.get(phase, 0.0) for phase in PHASES) +
+              "%10.1f %10d" % (total, rss))
+
+        rows.append([dimension, value, level, len(source)] + ["%.3f" % times.get(phase, 0.0) for phase in PHASES] +
+                    ["%.3f" % total, rss])
+
+    exponents = {phase: exponent(sizes, per_phase[phase]) for phase in PHASES}
+    print("%21s" % "exponent" + "".join("%10s" % format_exponent(exponents[phase]) for phase in PHASES) +
+          "%10s" % format_exponent(exponent(sizes, totals)))
+
+    return [(dimension, level, phase, k) for phase, k in exponents.items() if k is not None and k > SUPER_LINEAR]
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--pcl", default=os.path.join(here, "..", "src", "pcl"), help="compiler to measure")
+    parser.add_argument("--sweep", action="append", choices=sorted(SWEEPS),
+                        help="dimension to grow (all of them by default), can be repeated")
+    parser.add_argument("--levels", default="0,2", help="comma separated optimization levels (default 0,2)")
+    parser.add_argument("--steps", type=int, default=len(SWEEPS["functions"]),
+                        help="number of sizes of every sweep, from the smallest (default all)")
+    parser.add_argument("--repeat", type=int, default=3, help="compilations of every program, the fastest is kept")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the program generator")
+    parser.add_argument("--csv", help="also write every measurement to this file")
+    args = parser.parse_args()
+
+    levels = [int(level) for level in args.levels.split(",")]
+    rows, flagged = [], []
+
+    with tempfile.TemporaryDirectory(prefix="pcl-bench-") as tmp:
+        for dimension in args.sweep or sorted(SWEEPS):
+            for level in levels:
+                flagged += run_sweep(args, dimension, SWEEPS[dimension][:args.steps], level, tmp, rows)
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(["dimension", "value", "opt_level", "bytes"] + SHORT + ["total", "peak_rss_kb"])
+            writer.writerows(rows)
+
+    print()
+    if not flagged:
+        print("No phase grows faster than size^%.1f" % SUPER_LINEAR)
+    for dimension, level, phase, k in flagged:
+        print("Super-linear: %s grows as size^%.2f when %s grows at -O%d" % (phase, k, dimension, level))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,29 +1,47 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
 #include <string>
 
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/PassInstrumentation.h>
+#include <llvm/IR/PassManager.h>
 #include <llvm/IR/Value.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/raw_ostream.h>
 #include "llvm/Support/TargetRegistry.h"
-#include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/Transforms/Utils.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Transforms/Scalar/InductiveRangeCheckElimination.h>
 
 #include "ast.hpp"
+#include "cache.hpp"
 #include "codegen_table.hpp"
-#include "lexer.hpp"
+#include "compiler.hpp"
+#include "escape.hpp"
+#include "inliner.hpp"
+#include "linker.hpp"
 #include "symbol_table.hpp"
+#include "time_report.hpp"
 #include "types.hpp"
 
 using expr_ptr = std::unique_ptr<Expr>;
@@ -37,23 +55,14 @@ using fun_ptr = std::unique_ptr<Fun>;
 using program_ptr = std::unique_ptr<Program>;
 using type_ptr = std::shared_ptr<TypeInfo>;
 
-static SymbolTable symbol_table;
-
 using namespace llvm;
 
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-
-static CodegenTable codegen_table;
-
 //---------------------------------------------------------------------//
 //------------------Constructors/Getters/Setters-----------------------//
 //---------------------------------------------------------------------//
 
 Node::Node() {
-  this->line = line_num;
+  this->line = compiler->line_num;
 }
 
 int Node::get_line() const {
@@ -73,15 +82,31 @@ Stmt::Stmt()
 Boolean::Boolean(bool val)
   : Expr(), val(val) {}
 
+bool Boolean::get_val() const {
+  return this->val;
+}
+
 Char::Char(char val)
   : Expr(), val(val) {}
 
+char Char::get_val() const {
+  return this->val;
+}
+
 Integer::Integer(int val)
   : Expr(), val(val) {}
 
+int Integer::get_val() const {
+  return this->val;
+}
+
 Real::Real(double val)
   : Expr(), val(val) {}
 
+double Real::get_val() const {
+  return this->val;
+}
+
 String::String(std::string val)
   : Expr(), val(val) {}
 
@@ -91,17 +116,29 @@ Nil::Nil()
 Variable::Variable(std::string name)
   : Expr(), name(name) {}
 
+std::string Variable::get_name() const {
+  return this->name;
+}
+
 Array::Array(expr_ptr arr, expr_ptr index)
   : Expr(), arr(std::move(arr)), index(std::move(index)) {}
 
+const expr_ptr& Array::get_array() const {
+  return this->arr;
+}
+
 Deref::Deref(expr_ptr ptr)
-  : Expr(), ptr(std::move(ptr)) {}
+  : Expr(), ptr(std::move(ptr)), length(nullptr) {}
+
+Value* Deref::get_length() const {
+  return this->length;
+}
 
 AddressOf::AddressOf(expr_ptr var)
   : Expr(), var(std::move(var)) {}
 
 CallExpr::CallExpr(std::string fun_name, std::vector<expr_ptr> parameters)
-  : Expr(), fun_name(fun_name), parameters(std::move(parameters)) {}
+  : Expr(), fun_name(fun_name), parameters(std::move(parameters)), tail(false) {}
 
 Result::Result()
   : Expr() {}
@@ -175,7 +212,7 @@ void Fun::set_forward(bool forward_declaration) {
 }
 
 CallStmt::CallStmt(std::string fun_name, std::vector<expr_ptr> parameters)
-  : Stmt(), fun_name(fun_name), parameters(std::move(parameters)) {}
+  : Stmt(), fun_name(fun_name), parameters(std::move(parameters)), tail(false) {}
 
 Return::Return()
   : Stmt() {}
@@ -187,14 +224,15 @@ Dispose::Dispose(bool has_brackets, expr_ptr l_value)
   : Stmt(), has_brackets(has_brackets), l_value(std::move(l_value)) {}
 
 Program::Program(std::string name, body_ptr body)
-  : Stmt(), name(name), body(std::move(body)), optimize(false), asm_output(false), imm_output(false) {}
+  : Stmt(), name(name), body(std::move(body)), opt_level(0), asm_output(false), imm_output(false),
+    obj_output(false), imm_file(true), run(false), exit_code(0), cache(nullptr) {}
 
 void Program::set_file_name(std::string file_name) {
   this->file_name = file_name;
 }
 
-void Program::set_optimize(bool optimize) {
-  this->optimize = optimize;
+void Program::set_opt_level(int opt_level) {
+  this->opt_level = opt_level;
 }
 
 void Program::set_asm_output(bool asm_output) {
@@ -205,6 +243,37 @@ void Program::set_imm_output(bool imm_output) {
   this->imm_output = imm_output;
 }
 
+void Program::set_obj_output(bool obj_output) {
+  this->obj_output = obj_output;
+}
+
+void Program::set_imm_file(bool imm_file) {
+  this->imm_file = imm_file;
+}
+
+void Program::set_run(bool run) {
+  this->run = run;
+}
+
+int Program::get_exit_code() const {
+  return this->exit_code;
+}
+
+void Program::set_target(std::string cpu, std::string features) {
+  this->cpu = cpu;
+  this->features = features;
+}
+
+void Program::set_exe_output(std::string exe_name, std::string runtime, std::string loader) {
+  this->exe_name = exe_name;
+  this->runtime = runtime;
+  this->loader = loader;
+}
+
+void Program::set_cache(const CompileCache* cache) {
+  this->cache = cache;
+}
+
 //---------------------------------------------------------------------//
 //----------------------------Print------------------------------------//
 //---------------------------------------------------------------------//
@@ -439,53 +508,44 @@ void Program::print(std::ostream& out, int level) const {
 //---------------------------Semantic----------------------------------//
 //---------------------------------------------------------------------//
 
-// Special struct that doesn't live in a table but is used only to pass 
-// info from the semantic pass to the codegen pass
-struct nesting_info {
-  int nesting_level;
-  std::vector<std::shared_ptr<VarInfo>> prev_scope_vars;
-};
-
-std::map<std::string, nesting_info> semantic_to_codegen;
-
 // Make the library functions visible
 static void semantic_library_functions() {
   auto fun_entry = std::make_shared<FunctionEntry>(false, nullptr);
   auto parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<IntType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("writeInteger", fun_entry);
+  compiler->symbol_table.insert_lib_fun("writeInteger", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, nullptr);
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<BoolType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("writeBoolean", fun_entry);
+  compiler->symbol_table.insert_lib_fun("writeBoolean", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, nullptr);
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<CharType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("writeChar", fun_entry);
+  compiler->symbol_table.insert_lib_fun("writeChar", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, nullptr);
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("writeReal", fun_entry);
+  compiler->symbol_table.insert_lib_fun("writeReal", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, nullptr);
   parameter = std::make_pair(true, std::make_shared<VariableEntry>(std::make_shared<IArrType>(std::make_shared<CharType>())));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("writeString", fun_entry);
+  compiler->symbol_table.insert_lib_fun("writeString", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<IntType>());
-  symbol_table.insert_lib_fun("readInteger", fun_entry);
+  compiler->symbol_table.insert_lib_fun("readInteger", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<BoolType>());
-  symbol_table.insert_lib_fun("readBoolean", fun_entry);
+  compiler->symbol_table.insert_lib_fun("readBoolean", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<CharType>());
-  symbol_table.insert_lib_fun("readChar", fun_entry);
+  compiler->symbol_table.insert_lib_fun("readChar", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
-  symbol_table.insert_lib_fun("readReal", fun_entry);
+  compiler->symbol_table.insert_lib_fun("readReal", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, nullptr);
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<IntType>()));
@@ -493,81 +553,286 @@ static void semantic_library_functions() {
 
   parameter = std::make_pair(true, std::make_shared<VariableEntry>(std::make_shared<IArrType>(std::make_shared<CharType>())));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("readString", fun_entry);
+  compiler->symbol_table.insert_lib_fun("readString", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<IntType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<IntType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("abs", fun_entry);
+  compiler->symbol_table.insert_lib_fun("abs", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("fabs", fun_entry);
+  compiler->symbol_table.insert_lib_fun("fabs", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("sqrt", fun_entry);
+  compiler->symbol_table.insert_lib_fun("sqrt", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("sin", fun_entry);
+  compiler->symbol_table.insert_lib_fun("sin", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("cos", fun_entry);
+  compiler->symbol_table.insert_lib_fun("cos", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("tan", fun_entry);
+  compiler->symbol_table.insert_lib_fun("tan", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("arctan", fun_entry);
+  compiler->symbol_table.insert_lib_fun("arctan", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("exp", fun_entry);
+  compiler->symbol_table.insert_lib_fun("exp", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("ln", fun_entry);
+  compiler->symbol_table.insert_lib_fun("ln", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<RealType>());
-  symbol_table.insert_lib_fun("pi", fun_entry);
+  compiler->symbol_table.insert_lib_fun("pi", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<IntType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("trunc", fun_entry);
+  compiler->symbol_table.insert_lib_fun("trunc", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<IntType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<RealType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("round", fun_entry);
+  compiler->symbol_table.insert_lib_fun("round", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<IntType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<CharType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("ord", fun_entry);
+  compiler->symbol_table.insert_lib_fun("ord", fun_entry);
 
   fun_entry = std::make_shared<FunctionEntry>(false, std::make_shared<CharType>());
   parameter = std::make_pair(false, std::make_shared<VariableEntry>(std::make_shared<IntType>()));
   fun_entry->add_parameter(parameter);
-  symbol_table.insert_lib_fun("chr", fun_entry);
+  compiler->symbol_table.insert_lib_fun("chr", fun_entry);
 }
 
 // Helper error function
-static void error(const std::string& msg, const int& line) {
-  std::cerr << "Line: " << line << " Error: " << msg << std::endl;
-  exit(1);
+[[noreturn]] static void error(const std::string& msg, const int& line) {
+  throw CompileError("Line: " + std::to_string(line) + " Error: " + msg);
+}
+
+// The id under which a function declared in the scope of the given nesting level keeps its nesting info
+// Functions of different scopes may share a name, so it is made of the names of the enclosing functions
+static std::string function_id(int level, const std::string& name) {
+  return compiler->function_stack[level - 1] + "/" + name;
+}
+
+// Record that the function whose body is being checked uses a variable of an enclosing scope
+// The variables of the program are globals that every function reaches directly
+// With bounds checks an array of unknown size is captured along with its length, which nothing writes
+// to and is then passed by value like the other read-only scalars
+static void capture_variable(const std::string& name, type_ptr type) {
+  auto& ni = compiler->semantic_to_codegen[compiler->function_stack.back()];
+  int level = compiler->symbol_table.lookup_nesting_level(name);
+
+  if (level <= 1 || level >= ni.nesting_level)
+    return;
+
+  ni.captured.emplace(std::make_pair(level, name), std::make_shared<VarInfo>(name, level, type));
+
+  if (compiler->bounds_check && type->is(BasicType::IArray))
+    ni.captured.emplace(std::make_pair(level, "$length." + name),
+                        std::make_shared<VarInfo>("$length." + name, level, std::make_shared<IntType>()));
+}
+
+// Record that the function whose body is being checked writes to an l-value when it is a variable,
+// the result of the function or an element of an array variable
+// A variable that escapes may be written through the pointer or reference later from anywhere
+static void write_variable(const expr_ptr& l_value, bool escapes) {
+  if (auto array = dynamic_cast<Array*>(l_value.get()))
+    return write_variable(array->get_array(), escapes);
+
+  std::string name;
+  if (auto variable = dynamic_cast<Variable*>(l_value.get()))
+    name = variable->get_name();
+  else if (dynamic_cast<Result*>(l_value.get()))
+    name = "result";
+  else
+    return;
+
+  int level = compiler->symbol_table.lookup_nesting_level(name);
+
+  if (escapes) {
+    compiler->escaped_vars.emplace(level, name);
+    compiler->semantic_to_codegen[compiler->function_stack[level - 1]].escaped.insert(name);
+  }
+
+  auto& ni = compiler->semantic_to_codegen[compiler->function_stack.back()];
+  if (level > 1 && level < ni.nesting_level)
+    ni.written.emplace(level, name);
+}
+
+// Whether the elements of two arrays of known size are arrays of the same sizes, or not arrays
+static bool same_elements(type_ptr left, type_ptr right) {
+  auto left_subtype = std::static_pointer_cast<ArrType>(left)->get_subtype();
+  auto right_subtype = std::static_pointer_cast<ArrType>(right)->get_subtype();
+
+  if (!left_subtype->is(BasicType::Array))
+    return true;
+
+  int left_size = std::static_pointer_cast<ArrType>(left_subtype)->get_size();
+  int right_size = std::static_pointer_cast<ArrType>(right_subtype)->get_size();
+
+  return left_size == right_size && same_elements(left_subtype, right_subtype);
+}
+
+static bool is_scalar(type_ptr type) {
+  return type->is(BasicType::Integer) || type->is(BasicType::Real) || type->is(BasicType::Boolean)
+    || type->is(BasicType::Char) || type->is(BasicType::Pointer);
+}
+
+// A function also needs the variables that the functions it calls capture and the ones the functions
+// declared in it capture from outside of it, so these are propagated until nothing changes
+static void propagate_captures() {
+  auto& functions = compiler->semantic_to_codegen;
+
+  auto merge = [](nesting_info& to, const nesting_info& from) {
+    bool changed = false;
+
+    for (auto& var : from.captured)
+      if (var.first.first < to.nesting_level)
+        changed |= to.captured.insert(var).second;
+
+    return changed;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    for (auto& function : functions) {
+      auto& ni = function.second;
+
+      for (auto& callee : ni.callees) {
+        auto it = functions.find(callee);
+        if (it != functions.end())
+          changed |= merge(ni, it->second);
+      }
+
+      if (!function.first.empty())
+        changed |= merge(functions[ni.parent], ni);
+    }
+  }
+
+  // A captured scalar that nothing writes to while the function runs is passed by value,
+  // which needs the writes of the functions it calls
+  changed = true;
+  while (changed) {
+    changed = false;
+
+    for (auto& function : functions) {
+      auto& ni = function.second;
+
+      for (auto& callee : ni.callees) {
+        auto it = functions.find(callee);
+        if (it == functions.end())
+          continue;
+
+        for (auto& var : it->second.written)
+          if (var.first < ni.nesting_level)
+            changed |= ni.written.insert(var).second;
+      }
+    }
+  }
+
+  // The rest is reached through the frame, which must also hold what the functions it calls
+  // and the functions declared in it reach through theirs
+  std::map<std::string, std::set<std::pair<int, std::string>>> framed;
+  for (auto& function : functions) {
+    auto& ni = function.second;
+
+    for (auto it = ni.captured.rbegin(); it != ni.captured.rend(); it++) {
+      bool read_only = !ni.written.count(it->first) && !compiler->escaped_vars.count(it->first);
+
+      if (read_only && is_scalar(it->second->get_type()))
+        ni.lifted_vars.push_back(it->second);
+      else
+        framed[function.first].insert(it->first);
+    }
+  }
+
+  auto merge_framed = [&](const std::string& to, const std::string& from) {
+    bool changed = false;
+
+    for (auto& var : framed[from])
+      if (var.first < functions[to].nesting_level)
+        changed |= framed[to].insert(var).second;
+
+    return changed;
+  };
+
+  changed = true;
+  while (changed) {
+    changed = false;
+
+    for (auto& function : functions) {
+      for (auto& callee : function.second.callees)
+        if (functions.count(callee))
+          changed |= merge_framed(function.first, callee);
+
+      if (!function.first.empty())
+        changed |= merge_framed(function.second.parent, function.first);
+    }
+  }
+
+  // Innermost scope first
+  for (auto& function : functions)
+    for (auto it = function.second.captured.rbegin(); it != function.second.captured.rend(); it++)
+      if (framed[function.first].count(it->first))
+        function.second.captured_vars.push_back(it->second);
+
+  // Everything a function reaches through its frame from its parent's scope must be shared by the parent
+  std::map<std::string, std::map<std::string, std::shared_ptr<VarInfo>>> shared;
+  for (auto& function : functions)
+    if (!function.first.empty())
+      for (auto& var : function.second.captured_vars)
+        if (var->get_nesting_level() == function.second.nesting_level - 1)
+          shared[function.second.parent].emplace(var->get_name(), var);
+
+  for (auto& function : shared)
+    for (auto& var : function.second)
+      functions[function.first].shared_vars.push_back(var.second);
+}
+
+// A function is recursive when it can be reached again from the functions it calls
+static void find_recursive_functions() {
+  auto& functions = compiler->semantic_to_codegen;
+
+  for (auto& function : functions) {
+    std::set<std::string> reached;
+    std::vector<std::string> pending(function.second.callees.begin(), function.second.callees.end());
+
+    while (!pending.empty() && !reached.count(function.first)) {
+      std::string callee = pending.back();
+      pending.pop_back();
+
+      auto it = functions.find(callee);
+      if (it == functions.end() || !reached.insert(callee).second)
+        continue;
+
+      pending.insert(pending.end(), it->second.callees.begin(), it->second.callees.end());
+    }
+
+    function.second.recursive = reached.count(function.first);
+  }
 }
 
 void Boolean::semantic() {
@@ -587,7 +852,8 @@ void Real::semantic() {
 }
 
 void String::semantic() {
-  this->type = std::make_shared<ArrType>(val.length(), std::make_shared<CharType>());
+  // Strings end with a null character
+  this->type = std::make_shared<ArrType>(val.length() + 1, std::make_shared<CharType>());
 }
 
 void Nil::semantic() {
@@ -595,7 +861,7 @@ void Nil::semantic() {
 }
 
 void Variable::semantic() {
-  auto entry = symbol_table.lookup(this->name);
+  auto entry = compiler->symbol_table.lookup(this->name);
   if (!entry)
     error("Identifier " + this->name + " hasn't been declared", this->get_line());
 
@@ -604,6 +870,8 @@ void Variable::semantic() {
     error("Name \"" + this->name + "\" has already been declared and is not a variable", this->get_line());
 
   this->type = variable_entry->get_type();
+
+  capture_variable(this->name, this->type);
 }
 
 void Array::semantic() {
@@ -640,6 +908,7 @@ void Deref::semantic() {
 
 void AddressOf::semantic() {
   this->var->semantic();
+  write_variable(this->var, true);
 
   auto var_type = this->var->get_type();
 
@@ -648,7 +917,7 @@ void AddressOf::semantic() {
 
 // Helper function for the two call nodes
 type_ptr call_semantic(const std::string& fun_name, const std::vector<expr_ptr>& call_parameters, const int& line) {
-  auto entry = symbol_table.lookup(fun_name);
+  auto entry = compiler->symbol_table.lookup(fun_name);
   if (!entry)
     error("Name of function " + fun_name + " not found", line);
 
@@ -656,6 +925,11 @@ type_ptr call_semantic(const std::string& fun_name, const std::vector<expr_ptr>&
   if (!function_entry)
     error("Name \"" + fun_name + "\" has already been used and is not a function", line);
 
+  // The library functions capture nothing
+  int level = compiler->symbol_table.lookup_nesting_level(fun_name);
+  if (level > 0)
+    compiler->semantic_to_codegen[compiler->function_stack.back()].callees.insert(function_id(level, fun_name));
+
   for (auto& parameter : call_parameters)
     parameter->semantic();
 
@@ -684,6 +958,9 @@ type_ptr call_semantic(const std::string& fun_name, const std::vector<expr_ptr>&
       
       if (!compatible_types(fun_param_type, call_param_type))
         error("Type of argument in function call does not match function definition", line);
+
+      if (pass_by_reference)
+        write_variable(call_parameters[i], true);
     }
   }
 
@@ -695,7 +972,7 @@ void CallExpr::semantic() {
 }
 
 void Result::semantic() {
-  auto result = symbol_table.lookup("result");
+  auto result = compiler->symbol_table.lookup("result");
   if (!result)
     error("\"result\" variable not used within the body of a function that returns a result", this->get_line());
 
@@ -835,7 +1112,7 @@ void Block::semantic() {
 
 void VarNames::semantic() {
   for (auto& name : this->names) {
-    bool success = symbol_table.insert(name, std::make_shared<VariableEntry>(this->type));
+    bool success = compiler->symbol_table.insert(name, std::make_shared<VariableEntry>(this->type));
     if (!success)
       error("Variable name " + name + " has already been declared", this->get_line());
   }
@@ -848,7 +1125,7 @@ void VarDecl::semantic() {
 
 void LabelDecl::semantic() {
   for (auto& name : this->names) {
-    bool success = symbol_table.add_label(name);
+    bool success = compiler->symbol_table.add_label(name);
     if (!success)
       error("Label " + name + " has already been declared", this->get_line());
   }
@@ -861,6 +1138,8 @@ void Assign::semantic() {
   auto right_type = this->right->get_type();
   auto left_type = this->left->get_type();
 
+  write_variable(this->left, false);
+
   /*bool array = (right_type->is(BasicType::Array) || right_type->is(BasicType::IArray))
     || (left_type->is(BasicType::Array) || left_type->is(BasicType::IArray));
 
@@ -869,15 +1148,25 @@ void Assign::semantic() {
 
   if (!compatible_types(left_type, right_type))
     error("Value cannot be assigned due to type mismatch", this->get_line());
+
+  // Arrays are copied up to the size of the smaller one, which isn't known for an array of unknown size
+  // without bounds checks. The only array that can be assigned to one is an array of known size, which
+  // may then be longer
+  if (left_type->is(BasicType::IArray))
+    error("Arrays of unknown size cannot be assigned to", this->get_line());
+
+  // The elements are copied whole, so only the outermost sizes may differ
+  if (left_type->is(BasicType::Array) && !same_elements(left_type, right_type))
+    error("Arrays whose elements are arrays of different sizes cannot be assigned", this->get_line());
 }
 
 void Goto::semantic() {
-  if (!symbol_table.has_label(this->label))
+  if (!compiler->symbol_table.has_label(this->label))
     error("Label \"" + this->label + "\" hasn't been declared", this->get_line());
 }
 
 void Label::semantic() {
-  if (!symbol_table.has_label(this->label))
+  if (!compiler->symbol_table.has_label(this->label))
     error("Label \"" + this->label + "\" hasn't been declared", this->get_line());
 
   this->stmt->semantic();
@@ -918,7 +1207,7 @@ void Body::semantic() {
 void Fun::semantic() {
   // Check if function entry exists in the symbol table and if it does make sure that functions
   // with bodies are allowed only if the already existing entry belongs to a forward declaration 
-  auto entry = symbol_table.current_scope_lookup(this->fun_name);
+  auto entry = compiler->symbol_table.current_scope_lookup(this->fun_name);
   if (entry) {
     auto function_entry = std::dynamic_pointer_cast<FunctionEntry>(entry);
     if (!function_entry)
@@ -927,6 +1216,9 @@ void Fun::semantic() {
       error("Redeclaration of function is not permitted", this->get_line());
   }
 
+  // A forward declaration and the function it declares share the id
+  this->id = function_id(compiler->symbol_table.get_nesting_level(), this->fun_name);
+
   // Create the function entry in the symbol table that is inserted in the current scope
   auto fun_entry = std::make_shared<FunctionEntry>(this->forward_declaration, this->return_type);
 
@@ -938,34 +1230,40 @@ void Fun::semantic() {
   }
 
   if (!entry)
-    symbol_table.insert(this->fun_name, fun_entry);
+    compiler->symbol_table.insert(this->fun_name, fun_entry);
 
   // Open function's scope and insert the local variables and the result variable if not a procedure
   if (!this->forward_declaration) {
-    this->prev_scope_vars = symbol_table.get_prev_scope_vars();
+    compiler->symbol_table.open_scope();
 
-    symbol_table.open_scope();
-
-    this->nesting_level = symbol_table.get_nesting_level();
+    this->nesting_level = compiler->symbol_table.get_nesting_level();
 
     // Store this info outside of a table so that it presists after the semantic pass
+    // The variables the function captures are collected while its body is checked
     struct nesting_info ni;
     ni.nesting_level = this->nesting_level;
-    ni.prev_scope_vars = this->prev_scope_vars;
-    semantic_to_codegen[this->fun_name] = ni;
+    ni.parent = compiler->function_stack.back();
+    compiler->semantic_to_codegen[this->id] = ni;
+    compiler->function_stack.push_back(this->id);
 
-    for (auto& formal : this->formal_parameters)
-      for (auto& name : formal->get_names())
-        symbol_table.insert(name, std::make_shared<VariableEntry>(formal->get_type()));
+    for (auto& formal : this->formal_parameters) {
+      for (auto& name : formal->get_names()) {
+        compiler->symbol_table.insert(name, std::make_shared<VariableEntry>(formal->get_type()));
+
+        if (formal->get_pass_by_reference())
+          compiler->escaped_vars.emplace(this->nesting_level, name);
+      }
+    }
 
     if (this->return_type)
-      symbol_table.insert("result", std::make_shared<VariableEntry>(this->return_type));
+      compiler->symbol_table.insert("result", std::make_shared<VariableEntry>(this->return_type));
     else
-      symbol_table.insert("result", nullptr);
+      compiler->symbol_table.insert("result", nullptr);
 
     this->body->semantic();
 
-    symbol_table.close_scope();
+    compiler->function_stack.pop_back();
+    compiler->symbol_table.close_scope();
   }
 }
 
@@ -980,6 +1278,7 @@ void New::semantic() {
     this->size->semantic();
 
   this->l_value->semantic();
+  write_variable(this->l_value, false);
 
   auto l_value_type = this->l_value->get_type();
   if (!l_value_type->is(BasicType::Pointer)) {
@@ -1004,6 +1303,7 @@ void New::semantic() {
 
 void Dispose::semantic() {
   this->l_value->semantic();
+  write_variable(this->l_value, false);
 
   auto l_value_type = this->l_value->get_type();
   if (!l_value_type->is(BasicType::Pointer)) {
@@ -1023,796 +1323,1747 @@ void Dispose::semantic() {
 }
 
 void Program::semantic() {
-  symbol_table.open_scope();
+  compiler->symbol_table.open_scope();
 
   semantic_library_functions();
 
+  compiler->semantic_to_codegen[""].nesting_level = compiler->symbol_table.get_nesting_level();
+  compiler->function_stack.push_back("");
+
   this->body->semantic();
 
-  symbol_table.close_scope();
+  compiler->function_stack.pop_back();
+  compiler->symbol_table.close_scope();
+
+  propagate_captures();
+  find_recursive_functions();
 }
 
 //---------------------------------------------------------------------//
-//----------------------------Util-------------------------------------//
+//---------------------------Folding-----------------------------------//
 //---------------------------------------------------------------------//
 
-// Type shortcuts for:
-// char,bool: i8  (1 byte)
-// integer:   i32 (4 bytes)
-// real:      f64 (8 bytes)
-static Type* i8 = Type::getInt8Ty(TheContext);
-static Type* i32 = Type::getInt32Ty(TheContext);
-static Type* f64 = Type::getDoubleTy(TheContext);
+// Replace an expression or a statement with its folded form, if it has one
+static void fold(expr_ptr& expr) {
+  if (!expr)
+    return;
 
-static ConstantInt* c8(bool b) {
-  return ConstantInt::get(TheContext, APInt(8, b, true));
+  auto folded = expr->fold();
+  if (folded)
+    expr = std::move(folded);
 }
 
-static ConstantInt* c8(char c) {
-  return ConstantInt::get(TheContext, APInt(8, c, true));
+static void fold(stmt_ptr& stmt) {
+  if (!stmt)
+    return;
+
+  auto folded = stmt->fold();
+  if (folded)
+    stmt = std::move(folded);
 }
 
-static ConstantInt* c32(int n) {
-  return ConstantInt::get(TheContext, APInt(32, n, true));
+// Literals created by folding get their type the same way as the ones of the source
+static expr_ptr literal(expr_ptr expr) {
+  expr->semantic();
+  return expr;
 }
 
-static ConstantFP* c64(double d) {
-  return ConstantFP::get(TheContext, APFloat(d));
+static expr_ptr make_integer(int val) {
+  return literal(std::make_unique<Integer>(val));
 }
 
-static Type* to_llvm_type(type_ptr type) {
-  if (!type)
-    return Type::getVoidTy(TheContext);
+static expr_ptr make_real(double val) {
+  return literal(std::make_unique<Real>(val));
+}
 
-  switch(type->get_basic_type()) {
-    case BasicType::Integer:
-      return i32;
-    case BasicType::Real:
-      return f64;
-    case BasicType::Boolean:
-      return i8;
-    case BasicType::Char:
-      return i8;
-    case BasicType::Array:
-    {
-      auto array = std::static_pointer_cast<ArrType>(type);
-      return ArrayType::get(to_llvm_type(array->get_subtype()), array->get_size());
-    }
-    case BasicType::IArray:
-    {
-      auto iarray = std::static_pointer_cast<IArrType>(type);
-      return to_llvm_type(iarray->get_subtype());
-    }
-    case BasicType::Pointer:
-    {
-      auto ptr = std::static_pointer_cast<PtrType>(type);
-      return to_llvm_type(ptr->get_subtype())->getPointerTo();
-    }
-    default:
-      return nullptr;
-  }
+static expr_ptr make_boolean(bool val) {
+  return literal(std::make_unique<Boolean>(val));
 }
 
-static void init_module_and_pass_manager(bool optimize) {
-  TheModule = std::make_unique<Module>("PCL program", TheContext);
+// Integer and real literals as doubles, for the operators that work on both
+static bool numeric_literal(const expr_ptr& expr, double& val) {
+  if (auto integer = dynamic_cast<Integer*>(expr.get())) {
+    val = integer->get_val();
+    return true;
+  }
+
+  if (auto real = dynamic_cast<Real*>(expr.get())) {
+    val = real->get_val();
+    return true;
+  }
 
-  TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+  return false;
+}
 
-  if (optimize) {
-    TheFPM->add(createPromoteMemoryToRegisterPass());
-    TheFPM->add(createInstructionCombiningPass());
-    TheFPM->add(createGVNPass());
-    TheFPM->add(createCFGSimplificationPass());
+// Chars and booleans are compared as the i8 they are stored in
+static bool ordinal_literal(const expr_ptr& expr, int& val) {
+  if (auto c = dynamic_cast<Char*>(expr.get())) {
+    val = (signed char) c->get_val();
+    return true;
   }
 
-  TheFPM->doInitialization();
+  if (auto b = dynamic_cast<Boolean*>(expr.get())) {
+    val = b->get_val();
+    return true;
+  }
 
-  InitializeAllTargetInfos();
-  InitializeAllTargets();
-  InitializeAllTargetMCs();
-  InitializeAllAsmParsers();
-  InitializeAllAsmPrinters();
+  return false;
+}
 
-  auto TargetTriple = sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(TargetTriple);
+static bool is_integer_literal(const expr_ptr& expr, int val) {
+  auto integer = dynamic_cast<Integer*>(expr.get());
+  return integer && integer->get_val() == val;
+}
 
-  std::string Error;
-  auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+static bool is_real_literal(const expr_ptr& expr, double val) {
+  auto real = dynamic_cast<Real*>(expr.get());
+  return real && real->get_val() == val;
+}
 
-  if (!Target) {
-    errs() << Error;
-    exit(1);
+// Comparisons of reals are unordered like the fcmp instructions generated for them
+template <typename T>
+static bool compare(BinOp op, T left, T right, bool unordered) {
+  switch(op) {
+    case BinOp::EQ:
+      return unordered || left == right;
+    case BinOp::NE:
+      return unordered || left != right;
+    case BinOp::LT:
+      return unordered || left < right;
+    case BinOp::GT:
+      return unordered || left > right;
+    case BinOp::LE:
+      return unordered || left <= right;
+    case BinOp::GE:
+      return unordered || left >= right;
+    default:
+      return false;
   }
+}
 
-  auto CPU = "generic";
-  auto Features = "";
+expr_ptr Expr::fold() {
+  return nullptr;
+}
 
-  TargetOptions opt;
-  auto RM = Optional<Reloc::Model>();
-  auto TheTargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+stmt_ptr Stmt::fold() {
+  return nullptr;
+}
 
-  TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+bool Stmt::has_label() const {
+  return false;
 }
 
-static void codegen_library_functions() {
-  Type* ret_type;
-  std::vector<Type*> args;
-  std::vector<bool> parameters;
-  FunctionType* FT;
-  Function* F;
+expr_ptr Array::fold() {
+  ::fold(this->arr);
+  ::fold(this->index);
 
-  ret_type = Type::getVoidTy(TheContext);
-  args = std::vector<Type*>{i32};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "writeInteger", TheModule.get());
+  return nullptr;
+}
 
-  codegen_table.insert_lib_fun("writeInteger",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+expr_ptr Deref::fold() {
+  ::fold(this->ptr);
 
-  ret_type = Type::getVoidTy(TheContext);
-  args = std::vector<Type*>{i8};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "writeBoolean", TheModule.get());
+  return nullptr;
+}
 
-  codegen_table.insert_lib_fun("writeBoolean",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+expr_ptr AddressOf::fold() {
+  ::fold(this->var);
 
-  ret_type = Type::getVoidTy(TheContext);
-  args = std::vector<Type*>{i8};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "writeChar", TheModule.get());
+  return nullptr;
+}
 
-  codegen_table.insert_lib_fun("writeChar",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+expr_ptr CallExpr::fold() {
+  for (auto& parameter : this->parameters)
+    ::fold(parameter);
 
-  ret_type = Type::getVoidTy(TheContext);
-  args = std::vector<Type*>{f64};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "writeReal", TheModule.get());
+  return nullptr;
+}
 
-  codegen_table.insert_lib_fun("writeReal",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+expr_ptr BinaryExpr::fold() {
+  ::fold(this->left);
+  ::fold(this->right);
 
-  ret_type = Type::getVoidTy(TheContext);
-  args = std::vector<Type*>{i8->getPointerTo()};
-  parameters = std::vector<bool>{true};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "writeString", TheModule.get());
+  auto left_type = this->left->get_type();
+  auto right_type = this->right->get_type();
 
-  codegen_table.insert_lib_fun("writeString",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+  // AND,OR with a known left operand are either known or the right operand,
+  // while a known right operand can only be dropped when it doesn't decide the result
+  if (this->op == BinOp::AND || this->op == BinOp::OR) {
+    bool is_and = this->op == BinOp::AND;
 
-  ret_type = i32;
-  args = std::vector<Type*>{};
-  parameters = std::vector<bool>{};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "readInteger", TheModule.get());
+    if (auto left = dynamic_cast<Boolean*>(this->left.get()))
+      return (left->get_val() == is_and) ? std::move(this->right) : make_boolean(!is_and);
 
-  codegen_table.insert_lib_fun("readInteger",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+    if (auto right = dynamic_cast<Boolean*>(this->right.get()))
+      if (right->get_val() == is_and)
+        return std::move(this->left);
 
-  ret_type = i8;
-  args = std::vector<Type*>{};
-  parameters = std::vector<bool>{};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "readBoolean", TheModule.get());
+    return nullptr;
+  }
 
-  codegen_table.insert_lib_fun("readBoolean",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+  // Integer literals next to reals and in real divisions are converted here instead of with sitofp
+  bool real = left_type->is(BasicType::Real) || right_type->is(BasicType::Real) || this->op == BinOp::DIV;
+  if (real && dynamic_cast<Integer*>(this->right.get()))
+    this->right = make_real(static_cast<Integer*>(this->right.get())->get_val());
+  if (real && dynamic_cast<Integer*>(this->left.get()))
+    this->left = make_real(static_cast<Integer*>(this->left.get())->get_val());
+
+  double left_val, right_val;
+  bool known = numeric_literal(this->left, left_val) && numeric_literal(this->right, right_val);
+
+  if (known && this->type->is(BasicType::Integer)) {
+    // Integers wrap around like the instructions generated for them
+    int l = left_val, r = right_val;
+
+    switch(this->op) {
+      case BinOp::PLUS:
+        return make_integer((unsigned) l + (unsigned) r);
+      case BinOp::MINUS:
+        return make_integer((unsigned) l - (unsigned) r);
+      case BinOp::MUL:
+        return make_integer((unsigned) l * (unsigned) r);
+      case BinOp::INT_DIV:
+      case BinOp::MOD:
+        // Division by zero and overflow are left for the program to run into
+        if (r == 0 || (l == INT_MIN && r == -1))
+          return nullptr;
+
+        return make_integer(this->op == BinOp::INT_DIV ? l / r : l % r);
+      default:
+        return nullptr;
+    }
+  }
 
-  ret_type = i8;
-  args = std::vector<Type*>{};
-  parameters = std::vector<bool>{};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "readChar", TheModule.get());
+  if (known && this->type->is(BasicType::Real)) {
+    switch(this->op) {
+      case BinOp::PLUS:
+        return make_real(left_val + right_val);
+      case BinOp::MINUS:
+        return make_real(left_val - right_val);
+      case BinOp::MUL:
+        return make_real(left_val * right_val);
+      case BinOp::DIV:
+        return make_real(left_val / right_val);
+      default:
+        return nullptr;
+    }
+  }
 
-  codegen_table.insert_lib_fun("readChar",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+  if (known && this->type->is(BasicType::Boolean)) {
+    bool unordered = std::isnan(left_val) || std::isnan(right_val);
+    return make_boolean(compare(this->op, left_val, right_val, unordered));
+  }
 
-  ret_type = Type::getVoidTy(TheContext);
-  args = std::vector<Type*>{i32, i8->getPointerTo()};
-  parameters = std::vector<bool>{false, true};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "readString", TheModule.get());
+  int left_ordinal, right_ordinal;
+  if (ordinal_literal(this->left, left_ordinal) && ordinal_literal(this->right, right_ordinal))
+    return make_boolean(compare(this->op, left_ordinal, right_ordinal, false));
 
-  codegen_table.insert_lib_fun("readString",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+  // Identities that keep the type of the expression, x + 0.0 isn't one because of -0.0
+  switch(this->op) {
+    case BinOp::PLUS:
+      if (this->type->is(BasicType::Integer) && is_integer_literal(this->right, 0))
+        return std::move(this->left);
+      if (this->type->is(BasicType::Integer) && is_integer_literal(this->left, 0))
+        return std::move(this->right);
+      break;
 
-  ret_type = i32;
-  args = std::vector<Type*>{i32};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "abs", TheModule.get());
+    case BinOp::MINUS:
+      if (this->type->is(BasicType::Integer) && is_integer_literal(this->right, 0))
+        return std::move(this->left);
+      break;
 
-  codegen_table.insert_lib_fun("abs",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+    case BinOp::MUL:
+      if (is_integer_literal(this->right, 1) || is_real_literal(this->right, 1.0))
+        if (left_type->is(this->type->get_basic_type()))
+          return std::move(this->left);
+      if (is_integer_literal(this->left, 1) || is_real_literal(this->left, 1.0))
+        if (right_type->is(this->type->get_basic_type()))
+          return std::move(this->right);
+      break;
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "fabs", TheModule.get());
+    default:
+      break;
+  }
 
-  codegen_table.insert_lib_fun("fabs",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+  return nullptr;
+}
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "sqrt", TheModule.get());
+expr_ptr UnaryExpr::fold() {
+  ::fold(this->operand);
 
-  codegen_table.insert_lib_fun("sqrt",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+  switch(this->op) {
+    case UnOp::PLUS:
+      return std::move(this->operand);
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
-  parameters = std::vector<bool>{false};
-  FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "sin", TheModule.get());
+    case UnOp::MINUS:
+      if (auto integer = dynamic_cast<Integer*>(this->operand.get()))
+        return make_integer(-(unsigned) integer->get_val());
+      if (auto real = dynamic_cast<Real*>(this->operand.get()))
+        return make_real(-real->get_val());
+      break;
 
-  codegen_table.insert_lib_fun("sin",
-      std::make_shared<FunDef>(ret_type, parameters, F));
+    case UnOp::NOT:
+      if (auto boolean = dynamic_cast<Boolean*>(this->operand.get()))
+        return make_boolean(!boolean->get_val());
+      if (auto inner = dynamic_cast<UnaryExpr*>(this->operand.get()))
+        if (inner->op == UnOp::NOT)
+          return std::move(inner->operand);
+      break;
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
-  parameters = std::vector<bool>{false};
+    default:
+      break;
+  }
+
+  return nullptr;
+}
+
+stmt_ptr Block::fold() {
+  for (auto& stmt : this->stmt_list)
+    ::fold(stmt);
+
+  return nullptr;
+}
+
+bool Block::has_label() const {
+  for (auto& stmt : this->stmt_list)
+    if (stmt->has_label())
+      return true;
+
+  return false;
+}
+
+stmt_ptr Assign::fold() {
+  ::fold(this->left);
+  ::fold(this->right);
+
+  return nullptr;
+}
+
+stmt_ptr Label::fold() {
+  ::fold(this->stmt);
+
+  return nullptr;
+}
+
+bool Label::has_label() const {
+  return true;
+}
+
+// A known condition keeps only the branch that runs, unless the other one has a label
+stmt_ptr If::fold() {
+  ::fold(this->cond);
+  ::fold(this->if_stmt);
+  ::fold(this->else_stmt);
+
+  auto cond = dynamic_cast<Boolean*>(this->cond.get());
+  if (!cond)
+    return nullptr;
+
+  auto& taken = cond->get_val() ? this->if_stmt : this->else_stmt;
+  auto& skipped = cond->get_val() ? this->else_stmt : this->if_stmt;
+
+  if (skipped && skipped->has_label())
+    return nullptr;
+
+  return taken ? std::move(taken) : std::make_unique<Empty>();
+}
+
+bool If::has_label() const {
+  return this->if_stmt->has_label() || (this->else_stmt && this->else_stmt->has_label());
+}
+
+stmt_ptr While::fold() {
+  ::fold(this->cond);
+  ::fold(this->body);
+
+  auto cond = dynamic_cast<Boolean*>(this->cond.get());
+  if (cond && !cond->get_val() && !this->body->has_label())
+    return std::make_unique<Empty>();
+
+  return nullptr;
+}
+
+bool While::has_label() const {
+  return this->body->has_label();
+}
+
+stmt_ptr Body::fold() {
+  for (auto& local : this->local_decls)
+    local->fold();
+
+  this->block->fold();
+
+  return nullptr;
+}
+
+stmt_ptr Fun::fold() {
+  if (!this->forward_declaration)
+    this->body->fold();
+
+  return nullptr;
+}
+
+stmt_ptr CallStmt::fold() {
+  for (auto& parameter : this->parameters)
+    ::fold(parameter);
+
+  return nullptr;
+}
+
+stmt_ptr New::fold() {
+  ::fold(this->size);
+  ::fold(this->l_value);
+
+  return nullptr;
+}
+
+stmt_ptr Dispose::fold() {
+  ::fold(this->l_value);
+
+  return nullptr;
+}
+
+stmt_ptr Program::fold() {
+  this->body->fold();
+
+  return nullptr;
+}
+
+//---------------------------------------------------------------------//
+//--------------------------Tail calls---------------------------------//
+//---------------------------------------------------------------------//
+
+bool Stmt::mark_tail_calls(const std::string& fun_name, bool tail) {
+  return false;
+}
+
+// A statement is in tail position if the block is and it is the last one or if a return follows it
+bool Block::mark_tail_calls(const std::string& fun_name, bool tail) {
+  bool self = false;
+
+  for (size_t i = 0; i < this->stmt_list.size(); i++) {
+    bool last = i + 1 == this->stmt_list.size();
+    bool returns = !last && dynamic_cast<Return*>(this->stmt_list[i + 1].get());
+
+    self |= this->stmt_list[i]->mark_tail_calls(fun_name, (tail && last) || returns);
+  }
+
+  return self;
+}
+
+// Only result := call returns the value of the call
+bool Assign::mark_tail_calls(const std::string& fun_name, bool tail) {
+  auto call = dynamic_cast<CallExpr*>(this->right.get());
+  if (!tail || !call || !dynamic_cast<Result*>(this->left.get()))
+    return false;
+
+  return call->mark_tail_call(fun_name);
+}
+
+bool Label::mark_tail_calls(const std::string& fun_name, bool tail) {
+  return this->stmt->mark_tail_calls(fun_name, tail);
+}
+
+bool If::mark_tail_calls(const std::string& fun_name, bool tail) {
+  bool self = this->if_stmt->mark_tail_calls(fun_name, tail);
+  if (this->else_stmt)
+    self |= this->else_stmt->mark_tail_calls(fun_name, tail);
+
+  return self;
+}
+
+// The condition runs again after the body so only the statements followed by a return are in tail position
+bool While::mark_tail_calls(const std::string& fun_name, bool tail) {
+  return this->body->mark_tail_calls(fun_name, false);
+}
+
+bool Body::mark_tail_calls(const std::string& fun_name, bool tail) {
+  return this->block->mark_tail_calls(fun_name, tail);
+}
+
+bool CallStmt::mark_tail_calls(const std::string& fun_name, bool tail) {
+  this->tail = tail;
+
+  return tail && this->fun_name == fun_name;
+}
+
+bool CallExpr::mark_tail_call(const std::string& fun_name) {
+  this->tail = true;
+
+  return this->fun_name == fun_name;
+}
+
+//---------------------------------------------------------------------//
+//----------------------------Util-------------------------------------//
+//---------------------------------------------------------------------//
+
+static ConstantInt* c8(bool b) {
+  return ConstantInt::get(*compiler->TheContext, APInt(8, b, true));
+}
+
+static ConstantInt* c8(char c) {
+  return ConstantInt::get(*compiler->TheContext, APInt(8, c, true));
+}
+
+static ConstantInt* c32(int n) {
+  return ConstantInt::get(*compiler->TheContext, APInt(32, n, true));
+}
+
+static ConstantFP* c64(double d) {
+  return ConstantFP::get(*compiler->TheContext, APFloat(d));
+}
+
+static Type* to_llvm_type(type_ptr type) {
+  if (!type)
+    return Type::getVoidTy(*compiler->TheContext);
+
+  switch(type->get_basic_type()) {
+    case BasicType::Integer:
+      return compiler->i32;
+    case BasicType::Real:
+      return compiler->f64;
+    case BasicType::Boolean:
+      return compiler->i8;
+    case BasicType::Char:
+      return compiler->i8;
+    case BasicType::Array:
+    {
+      auto array = std::static_pointer_cast<ArrType>(type);
+      return ArrayType::get(to_llvm_type(array->get_subtype()), array->get_size());
+    }
+    case BasicType::IArray:
+    {
+      auto iarray = std::static_pointer_cast<IArrType>(type);
+      return to_llvm_type(iarray->get_subtype());
+    }
+    case BasicType::Pointer:
+    {
+      auto ptr = std::static_pointer_cast<PtrType>(type);
+      auto subtype = ptr->get_subtype();
+
+      // With bounds checks a pointer to an array of unknown size is a pair of the pointer to the elements
+      // and their number
+      if (compiler->bounds_check && subtype && subtype->is(BasicType::IArray))
+        return StructType::get(*compiler->TheContext, {to_llvm_type(subtype)->getPointerTo(), compiler->i32});
+
+      return to_llvm_type(subtype)->getPointerTo();
+    }
+    default:
+      return nullptr;
+  }
+}
+
+static Value* fat_pointer(Value* elements, Value* length) {
+  Type* type = StructType::get(*compiler->TheContext, {elements->getType(), compiler->i32});
+
+  Value* fat = compiler->Builder.CreateInsertValue(UndefValue::get(type), elements, 0);
+  return compiler->Builder.CreateInsertValue(fat, length, 1, "fat_pointer");
+}
+
+// Convert a pointer to the type of the variable or parameter it is given to: nil to any pointer and a pointer
+// to an array of known size to a pointer to an array of unknown size. With bounds checks the latter takes the
+// size of its array as the length and nil a length of 0. Other values are returned as they are
+static Value* convert_pointer(Value* value, Type* type) {
+  Type* from = value->getType();
+  if (from == type || !from->isPointerTy())
+    return value;
+
+  auto fat = dyn_cast<StructType>(type);
+  Value* elements = compiler->Builder.CreateBitCast(value, fat ? fat->getElementType(0) : type);
+  if (!fat)
+    return elements;
+
+  Value* length = c32(0);
+  if (auto array = dyn_cast<ArrayType>(cast<PointerType>(from)->getElementType()))
+    length = c32(array->getNumElements());
+
+  return fat_pointer(elements, length);
+}
+
+// Every alloca goes to the entry block so that it is allocated once per call even when it is
+// created in a loop, which is also where mem2reg and SROA look for the slots they promote
+static AllocaInst* entry_alloca(Type* type, const std::string& name = "") {
+  BasicBlock& entry = compiler->Builder.GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> builder(&entry, entry.begin());
+
+  return builder.CreateAlloca(type, nullptr, name);
+}
+
+// A local array allocated on the heap in the entry block, so that recursive calls in tail position keep it
+static Value* heap_array(Type* type, const std::string& name) {
+  BasicBlock& entry = compiler->Builder.GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> builder(&entry, entry.begin());
+
+  const DataLayout& DL = compiler->TheModule->getDataLayout();
+  Value* size = ConstantInt::get(Type::getInt64Ty(*compiler->TheContext), DL.getTypeAllocSize(type));
+  Function* malloc = compiler->codegen_table.lookup_fun("malloc")->get_function();
+  Value* memory = builder.CreateCall(malloc, std::vector<Value*>{size}, name + ".heap");
+
+  compiler->codegen_table.insert_heap_array(memory);
+
+  return builder.CreateBitCast(memory, type->getPointerTo(), name);
+}
+
+// Free the local arrays on the heap before the function returns
+static void free_heap_arrays(IRBuilder<>& builder) {
+  Function* free = compiler->codegen_table.lookup_fun("free")->get_function();
+
+  for (auto memory : compiler->codegen_table.get_heap_arrays())
+    builder.CreateCall(free, std::vector<Value*>{memory});
+}
+
+// The value of an expression that needs memory only lives until the end of its statement,
+// so the temporaries of different statements can share stack slots
+static AllocaInst* temporary_alloca(Type* type, const std::string& name = "") {
+  AllocaInst* alloca = entry_alloca(type, name);
+
+  compiler->Builder.CreateLifetimeStart(alloca);
+  compiler->temporaries.push_back(alloca);
+
+  return alloca;
+}
+
+// End the lifetime of the temporaries created since the mark, unless the block has already jumped away
+static void end_temporaries(size_t mark) {
+  if (!compiler->Builder.GetInsertBlock()->getTerminator())
+    for (size_t i = mark; i < compiler->temporaries.size(); i++)
+      compiler->Builder.CreateLifetimeEnd(compiler->temporaries[i]);
+
+  compiler->temporaries.resize(mark);
+}
+
+// Turn the target options of the command line into the cpu and feature string of the target machine
+// The cpu "native" selects the host cpu along with all of its features, while the
+// features are a comma separated list of +feature or -feature entries like llc's -mattr
+static void resolve_target(std::string& cpu, std::string& features) {
+  std::string host_features;
+
+  if (cpu.empty()) {
+    cpu = "generic";
+  } else if (cpu == "native") {
+    cpu = sys::getHostCPUName().str();
+
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures)) {
+      SubtargetFeatures F;
+      for (auto& feature : HostFeatures)
+        F.AddFeature(feature.first(), feature.second);
+      host_features = F.getString();
+    }
+  }
+
+  if (!host_features.empty())
+    features = features.empty() ? host_features : host_features + "," + features;
+}
+
+static void init_module_and_pass_manager(int opt_level, std::string cpu, std::string features) {
+  compiler->TheModule = std::make_unique<Module>("PCL program", *compiler->TheContext);
+
+  auto TargetTriple = sys::getDefaultTargetTriple();
+  compiler->TheModule->setTargetTriple(TargetTriple);
+
+  std::string Error;
+  auto Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+
+  if (!Target)
+    throw CompileError(Error);
+
+  std::string CPU = cpu, Features = features;
+  resolve_target(CPU, Features);
+
+  TargetOptions opt;
+  auto RM = Optional<Reloc::Model>();
+  auto CM = Optional<CodeModel::Model>();
+  auto OL = (opt_level >= 3) ? CodeGenOpt::Aggressive : CodeGenOpt::Default;
+  compiler->TheTargetMachine = std::unique_ptr<TargetMachine>(Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM, CM, OL));
+
+  compiler->TheModule->setDataLayout(compiler->TheTargetMachine->createDataLayout());
+}
+
+// Run the default module pipeline of the new pass manager for the optimization level over the
+// whole module so that every function and not only main gets optimized. The pipeline includes
+// mem2reg, SROA, inlining, LICM, loop and SLP vectorization, GVN and global dead code elimination
+static void optimize_module(int opt_level) {
+  PipelineTuningOptions PTO;
+  PTO.LoopVectorization = opt_level > 1;
+  PTO.SLPVectorization = opt_level > 1;
+
+  // Every pass run is recorded in the time report nested inside the optimization phase
+  PassInstrumentationCallbacks PIC;
+  if (TimeReport* report = compiler->report.get()) {
+    PIC.registerBeforePassCallback([report](StringRef name, Any) {
+      report->begin(name.str());
+      return true;
+    });
+    PIC.registerAfterPassCallback([report](StringRef, Any) { report->end(); });
+    PIC.registerAfterPassInvalidatedCallback([report](StringRef) { report->end(); });
+  }
+
+  PassBuilder PB(compiler->TheTargetMachine.get(), PTO, None, &PIC);
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  PassBuilder::OptimizationLevel level;
+  switch (opt_level) {
+    case 1:
+      level = PassBuilder::OptimizationLevel::O1;
+      break;
+    case 2:
+      level = PassBuilder::OptimizationLevel::O2;
+      break;
+    default:
+      level = PassBuilder::OptimizationLevel::O3;
+      break;
+  }
+
+  // The bounds checks of counted loops are taken out of most of their iterations by splitting them
+  // into a main loop that can't go out of bounds and the iterations before and after it
+  // The loop pipeline has already rotated the loops by then, and runs this once per function
+  if (compiler->bounds_check)
+    PB.registerLateLoopOptimizationsEPCallback([](LoopPassManager& LPM, PassBuilder::OptimizationLevel) {
+      LPM.addPass(IRCEPass());
+    });
+
+  // The memory of new that never leaves its function is moved to the stack once the pointer variables
+  // have been promoted to registers and the pointers can be followed through the code. This runs once at
+  // the end of the simplification of every function rather than after each of the peephole passes
+  unsigned long long max_size = compiler->max_stack_array;
+  PB.registerScalarOptimizerLateEPCallback([max_size](FunctionPassManager& FPM, PassBuilder::OptimizationLevel) {
+    FPM.addPass(HeapToStackPass(max_size));
+  });
+
+  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(level);
+  MPM.run(*compiler->TheModule, MAM);
+}
+
+// Run the codegen passes of the target machine over the module and emit assembly
+// or object code into the buffer without going through an intermediate file
+static void emit_code(SmallVectorImpl<char>& buffer, CodeGenFileType file_type) {
+  raw_svector_ostream os(buffer);
+  legacy::PassManager pass;
+
+  if (compiler->TheTargetMachine->addPassesToEmitFile(pass, os, nullptr, file_type))
+    throw CompileError("The target machine can't emit a file of this type");
+
+  pass.run(*compiler->TheModule);
+}
+
+// Failures of the JIT end the compilation like any other error
+static void check_jit(Error err) {
+  if (err)
+    throw CompileError("JIT error: " + toString(std::move(err)));
+}
+
+template <typename T>
+static T check_jit(Expected<T> value) {
+  check_jit(value.takeError());
+  return std::move(*value);
+}
+
+// Hand the module to an ORC JIT for the same target and call main in-process
+// The pcl runtime is linked into the compiler so its functions resolve from the process itself
+static int run_module() {
+  orc::JITTargetMachineBuilder JTMB(compiler->TheTargetMachine->getTargetTriple());
+  JTMB.setCPU(compiler->TheTargetMachine->getTargetCPU().str());
+  JTMB.addFeatures(SubtargetFeatures(compiler->TheTargetMachine->getTargetFeatureString()).getFeatures());
+  JTMB.setCodeGenOptLevel(compiler->TheTargetMachine->getOptLevel());
+
+  auto JIT = check_jit(orc::LLJITBuilder().setJITTargetMachineBuilder(std::move(JTMB)).create());
+
+  char GlobalPrefix = JIT->getDataLayout().getGlobalPrefix();
+  JIT->getMainJITDylib().addGenerator(
+      check_jit(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(GlobalPrefix)));
+
+  // The JIT takes the module and shares the context it lives in. Builder and the cached types keep pointing into the
+  // context, so the compiler instance keeps it alive after the JIT is gone
+  compiler->TheJITContext = orc::ThreadSafeContext(std::move(compiler->TheContext));
+  check_jit(JIT->addIRModule(orc::ThreadSafeModule(std::move(compiler->TheModule), compiler->TheJITContext)));
+
+  auto Main = check_jit(JIT->lookup("main"));
+  auto main_function = (int (*)()) Main.getAddress();
+
+  return main_function();
+}
+
+// Write the contents of the buffer to the file with the given name
+static void write_file(const std::string& name, const std::string& buffer) {
+  std::error_code EC;
+  raw_fd_ostream fd_os(name, EC, sys::fs::OF_None);
+
+  if (EC)
+    throw CompileError("Error opening output file: " + EC.message());
+
+  fd_os.write(buffer.data(), buffer.size());
+}
+
+static void codegen_library_functions() {
+  Type* ret_type;
+  std::vector<Type*> args;
+  std::vector<bool> parameters;
+  FunctionType* FT;
+  Function* F;
+
+  ret_type = Type::getVoidTy(*compiler->TheContext);
+  args = std::vector<Type*>{compiler->i32};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "writeInteger", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("writeInteger",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = Type::getVoidTy(*compiler->TheContext);
+  args = std::vector<Type*>{compiler->i8};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "writeBoolean", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("writeBoolean",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = Type::getVoidTy(*compiler->TheContext);
+  args = std::vector<Type*>{compiler->i8};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "writeChar", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("writeChar",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = Type::getVoidTy(*compiler->TheContext);
+  args = std::vector<Type*>{compiler->f64};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "writeReal", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("writeReal",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = Type::getVoidTy(*compiler->TheContext);
+  args = std::vector<Type*>{compiler->i8->getPointerTo()};
+  parameters = std::vector<bool>{true};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "writeString", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("writeString",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->i32;
+  args = std::vector<Type*>{};
+  parameters = std::vector<bool>{};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "cos", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "readInteger", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("cos",
+  compiler->codegen_table.insert_lib_fun("readInteger",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
+  ret_type = compiler->i8;
+  args = std::vector<Type*>{};
+  parameters = std::vector<bool>{};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "readBoolean", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("readBoolean",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->i8;
+  args = std::vector<Type*>{};
+  parameters = std::vector<bool>{};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "readChar", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("readChar",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = Type::getVoidTy(*compiler->TheContext);
+  args = std::vector<Type*>{compiler->i32, compiler->i8->getPointerTo()};
+  parameters = std::vector<bool>{false, true};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "readString", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("readString",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->i32;
+  args = std::vector<Type*>{compiler->i32};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "tan", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "abs", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("tan",
+  compiler->codegen_table.insert_lib_fun("abs",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "arctan", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "fabs", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("arctan",
+  compiler->codegen_table.insert_lib_fun("fabs",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "exp", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "sqrt", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("exp",
+  compiler->codegen_table.insert_lib_fun("sqrt",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = f64;
-  args = std::vector<Type*>{f64};
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "ln", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "sin", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("ln",
+  compiler->codegen_table.insert_lib_fun("sin",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = f64;
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "cos", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("cos",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "tan", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("tan",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "arctan", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("arctan",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  // arctan is generated as a call to atan of the C math library, which is declared before the functions and
+  // variables of the program so that they are the ones renamed if they are also called atan
+  F = Function::Create(FT, Function::ExternalLinkage, "atan", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("$atan",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "exp", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("exp",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->f64;
+  args = std::vector<Type*>{compiler->f64};
+  parameters = std::vector<bool>{false};
+  FT = FunctionType::get(ret_type, args, false);
+  F = Function::Create(FT, Function::ExternalLinkage, "ln", compiler->TheModule.get());
+
+  compiler->codegen_table.insert_lib_fun("ln",
+      std::make_shared<FunDef>(ret_type, parameters, F));
+
+  ret_type = compiler->f64;
   args = std::vector<Type*>{};
   parameters = std::vector<bool>{};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "pi", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "pi", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("pi",
+  compiler->codegen_table.insert_lib_fun("pi",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = i32;
-  args = std::vector<Type*>{f64};
+  ret_type = compiler->i32;
+  args = std::vector<Type*>{compiler->f64};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "trunc_", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "trunc_", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("trunc",
+  compiler->codegen_table.insert_lib_fun("trunc",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = i32;
-  args = std::vector<Type*>{f64};
+  ret_type = compiler->i32;
+  args = std::vector<Type*>{compiler->f64};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "round_", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "round_", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("round",
+  compiler->codegen_table.insert_lib_fun("round",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = i32;
-  args = std::vector<Type*>{i8};
+  ret_type = compiler->i32;
+  args = std::vector<Type*>{compiler->i8};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "ord", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "ord", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("ord",
+  compiler->codegen_table.insert_lib_fun("ord",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = i8;
-  args = std::vector<Type*>{i32};
+  ret_type = compiler->i8;
+  args = std::vector<Type*>{compiler->i32};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "chr", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "chr", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("chr",
+  compiler->codegen_table.insert_lib_fun("chr",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = i8->getPointerTo();
-  args = std::vector<Type*>{Type::getInt64Ty(TheContext)};
+  ret_type = compiler->i8->getPointerTo();
+  args = std::vector<Type*>{Type::getInt64Ty(*compiler->TheContext)};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "malloc_", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "malloc_", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("malloc",
+  compiler->codegen_table.insert_lib_fun("malloc",
       std::make_shared<FunDef>(ret_type, parameters, F));
 
-  ret_type = Type::getVoidTy(TheContext);
-  args = std::vector<Type*>{i8->getPointerTo()};
+  ret_type = Type::getVoidTy(*compiler->TheContext);
+  args = std::vector<Type*>{compiler->i8->getPointerTo()};
   parameters = std::vector<bool>{false};
   FT = FunctionType::get(ret_type, args, false);
-  F = Function::Create(FT, Function::ExternalLinkage, "free", TheModule.get());
+  F = Function::Create(FT, Function::ExternalLinkage, "free", compiler->TheModule.get());
 
-  codegen_table.insert_lib_fun("free",
+  compiler->codegen_table.insert_lib_fun("free",
       std::make_shared<FunDef>(ret_type, parameters, F));
+
+  // Reports an index out of bounds with its line and exits, only called when arrays are bounds checked
+  if (compiler->bounds_check) {
+    ret_type = Type::getVoidTy(*compiler->TheContext);
+    args = std::vector<Type*>{compiler->i32, compiler->i32, compiler->i32};
+    parameters = std::vector<bool>{false, false, false};
+    FT = FunctionType::get(ret_type, args, false);
+    F = Function::Create(FT, Function::ExternalLinkage, "bounds_error", compiler->TheModule.get());
+    F->setDoesNotReturn();
+    F->addFnAttr(Attribute::Cold);
+
+    compiler->codegen_table.insert_lib_fun("$bounds_error",
+        std::make_shared<FunDef>(ret_type, parameters, F));
+  }
 }
 
 //---------------------------------------------------------------------//
 //--------------------------Codegen------------------------------------//
 //---------------------------------------------------------------------//
 
-Value* Boolean::codegen() {
+Value* Expr::codegen() {
+  return this->codegen_value();
+}
+
+Value* Expr::codegen_address() {
+  return nullptr;
+}
+
+void Expr::codegen_branch(BasicBlock* true_block, BasicBlock* false_block) {
+  size_t mark = compiler->temporaries.size();
+
+  Value* cond = compiler->Builder.CreateICmpNE(this->codegen_value(), c8(false), "cond");
+  end_temporaries(mark);
+
+  compiler->Builder.CreateCondBr(cond, true_block, false_block);
+}
+
+Value* Boolean::codegen_value() {
   return c8(this->val);
 }
 
-Value* Char::codegen() {
+Value* Char::codegen_value() {
   return c8(this->val);
 }
 
-Value* Integer::codegen() {
+Value* Integer::codegen_value() {
   return c32(this->val);
 }
 
-Value* Real::codegen() {
-  return c64(this->val);
-}
+Value* Real::codegen_value() {
+  return c64(this->val);
+}
+
+// Like the arrays of unknown size a string is used through a pointer to its first character
+Value* String::codegen_value() {
+  return this->codegen_address();
+}
+
+Value* String::codegen_address() {
+  return compiler->Builder.CreateGlobalStringPtr(this->val);
+}
+
+// Nil has no type of its own and is converted to the pointer it is assigned to or passed as
+Value* Nil::codegen_value() {
+  return ConstantPointerNull::get(compiler->i8->getPointerTo());
+}
+
+Value* Variable::codegen_value() {
+  return compiler->Builder.CreateLoad(this->codegen_address());
+}
+
+Value* Variable::codegen_address() {
+  Value* v = compiler->codegen_table.lookup_var(this->name);
+
+  return v ? v : compiler->codegen_table.lookup_global_var(this->name);
+}
+
+Value* Array::codegen_value() {
+  return compiler->Builder.CreateLoad(this->codegen_address());
+}
+
+// The length of an array once its address has been generated, or nullptr when it isn't known: arrays of
+// known size have their size, the arrays of unknown size a function takes or captures come with their length
+// and so do the pointers to them
+static Value* array_length(Expr* arr) {
+  auto type = arr->get_type();
+  if (type->is(BasicType::Array))
+    return c32(std::static_pointer_cast<ArrType>(type)->get_size());
+
+  if (auto variable = dynamic_cast<Variable*>(arr))
+    if (Value* length = compiler->codegen_table.lookup_var("$length." + variable->get_name()))
+      return compiler->Builder.CreateLoad(length, "length");
+
+  if (auto deref = dynamic_cast<Deref*>(arr))
+    return deref->get_length();
+
+  return nullptr;
+}
+
+// Indices are compared as unsigned so that the negative ones are out of bounds too, and a bad one branches
+// to a call that never returns, which the optimizer keeps out of the way of the loop it is in
+static void check_bounds(Value* index, Value* length, int line) {
+  Function* TheFunction = compiler->Builder.GetInsertBlock()->getParent();
+
+  BasicBlock* OutOfBoundsBB = BasicBlock::Create(*compiler->TheContext, "out_of_bounds", TheFunction);
+  BasicBlock* InBoundsBB = BasicBlock::Create(*compiler->TheContext, "in_bounds", TheFunction);
+
+  Value* in_bounds = compiler->Builder.CreateICmpULT(index, length, "in_bounds");
+  compiler->Builder.CreateCondBr(in_bounds, InBoundsBB, OutOfBoundsBB);
+
+  compiler->Builder.SetInsertPoint(OutOfBoundsBB);
+  Function* bounds_error = compiler->codegen_table.lookup_fun("$bounds_error")->get_function();
+  compiler->Builder.CreateCall(bounds_error, std::vector<Value*>{c32(line), index, length});
+  compiler->Builder.CreateUnreachable();
+
+  compiler->Builder.SetInsertPoint(InBoundsBB);
+}
+
+Value* Array::codegen_address() {
+  Value* arr = this->arr->codegen_address();
+  Value* index = this->index->codegen_value();
+
+  PointerType* pt = dyn_cast<PointerType>(arr->getType());
+  if (pt) {
+    // Without a length only the negative indices are caught
+    if (compiler->bounds_check) {
+      Value* length = array_length(this->arr.get());
+      check_bounds(index, length ? length : c32(INT_MAX), this->get_line());
+    }
+
+    if (pt->getElementType()->isArrayTy()) {
+      return compiler->Builder.CreateInBoundsGEP(arr, std::vector<Value*>{c32(0), index}, "array_gep");
+    } else {
+      return compiler->Builder.CreateInBoundsGEP(arr, index, "iarray_gep");
+    }
+  } else {
+    return nullptr;
+  }
+}
+
+Value* Deref::codegen_value() {
+  return compiler->Builder.CreateLoad(this->codegen_address());
+}
+
+Value* Deref::codegen_address() {
+  Value* ptr = this->ptr->codegen_value();
+
+  if (ptr->getType()->isStructTy()) {
+    this->length = compiler->Builder.CreateExtractValue(ptr, 1, "length");
+    ptr = compiler->Builder.CreateExtractValue(ptr, 0, "elements");
+  }
+
+  return ptr;
+}
+
+Value* AddressOf::codegen_value() {
+  Value* address = this->var->codegen_address();
+
+  if (compiler->bounds_check && this->var->get_type()->is(BasicType::IArray)) {
+    Value* length = array_length(this->var.get());
+    return fat_pointer(address, length ? length : c32(INT_MAX));
+  }
+
+  return address;
+}
+
+// Follow the parent frames from the frame of a function to the frame of the enclosing function
+// at the given nesting level, which holds the captured variables of the level right above it
+static Value* enclosing_frame(Value* frame, std::shared_ptr<FunDef>& owner, int nesting_level) {
+  while (owner->get_nesting_level() > nesting_level) {
+    frame = compiler->Builder.CreateStructGEP(frame, 0);
+    frame = compiler->Builder.CreateLoad(frame);
+    owner = owner->get_parent();
+  }
+
+  return frame;
+}
+
+// Address of a captured variable, starting from the frame of a function
+static Value* captured_address(Value*& frame, std::shared_ptr<FunDef>& owner, const std::shared_ptr<VarInfo>& var) {
+  frame = enclosing_frame(frame, owner, var->get_nesting_level() + 1);
+
+  Value* v = compiler->Builder.CreateStructGEP(frame, owner->frame_position(var));
+  return compiler->Builder.CreateLoad(v);
+}
+
+// Two functions of the same nesting level can share a frame if they capture the same variables
+static bool same_frame(std::shared_ptr<FunDef>& a, std::shared_ptr<FunDef>& b) {
+  if (a == b)
+    return true;
+
+  if (a->get_frame_type() != b->get_frame_type() || a->has_parent_frame() != b->has_parent_frame())
+    return false;
+
+  auto a_vars = a->get_frame_vars();
+  auto b_vars = b->get_frame_vars();
+  for (size_t i = 0; i < a_vars.size(); i++)
+    if (a_vars[i]->get_name() != b_vars[i]->get_name())
+      return false;
+
+  return true;
+}
+
+// With a display the variables a function shares with the functions declared in it are published in a record
+// of pointers to them, and the display holds the record of the latest activation of every nesting level
+static StructType* display_record_type(std::shared_ptr<FunDef>& fun) {
+  std::vector<Type*> types;
+
+  for (auto& var : fun->get_shared_vars())
+    types.push_back(to_llvm_type(var->get_type())->getPointerTo());
+
+  return StructType::get(*compiler->TheContext, types);
+}
+
+static Value* display_entry(int nesting_level) {
+  GlobalVariable* display = compiler->TheModule->getNamedGlobal("pcl.display");
+
+  return compiler->Builder.CreateInBoundsGEP(display, std::vector<Value*>{c32(0), c32(nesting_level)});
+}
+
+// Publish the record of the current function in the display and keep the record it replaces
+// which is restored when the function returns
+static void open_display_record(std::shared_ptr<FunDef>& fun) {
+  if (!compiler->display || fun->get_shared_vars().empty())
+    return;
+
+  Value* record = entry_alloca(display_record_type(fun), "display_record");
+  compiler->codegen_table.insert_var("$record", record);
+
+  Value* entry = display_entry(fun->get_nesting_level());
+  compiler->codegen_table.insert_var("$saved_record", compiler->Builder.CreateLoad(entry));
+
+  compiler->Builder.CreateStore(compiler->Builder.CreateBitCast(record, compiler->i8->getPointerTo()), entry);
+}
+
+static void close_display_record() {
+  Value* saved = compiler->codegen_table.lookup_var("$saved_record");
+  if (saved)
+    compiler->Builder.CreateStore(saved, display_entry(compiler->codegen_table.get_current_fun()->get_nesting_level()));
+}
+
+// Store the address of a variable of the current function in its record if it is shared
+static void share_variable(const std::string& name, Value* address) {
+  Value* record = compiler->codegen_table.lookup_var("$record");
+  if (!record)
+    return;
+
+  int position = compiler->codegen_table.get_current_fun()->shared_position(name);
+  if (position >= 0)
+    compiler->Builder.CreateStore(address, compiler->Builder.CreateStructGEP(record, position));
+}
+
+// Address of a captured variable from the record of the function that declares it
+static Value* display_address(std::shared_ptr<FunDef> owner, const std::shared_ptr<VarInfo>& var) {
+  while (owner->get_nesting_level() > var->get_nesting_level())
+    owner = owner->get_parent();
+
+  Value* record = compiler->Builder.CreateLoad(display_entry(owner->get_nesting_level()));
+  record = compiler->Builder.CreateBitCast(record, display_record_type(owner)->getPointerTo());
+
+  Value* v = compiler->Builder.CreateStructGEP(record, owner->shared_position(var->get_name()));
+  return compiler->Builder.CreateLoad(v);
+}
+
+// Build the frame of the callee from the frame and the local variables of the caller
+static Value* callee_frame(std::shared_ptr<FunDef>& callee) {
+  StructType* st = callee->get_frame_type();
+  int callee_nesting_level = callee->get_nesting_level();
+  int current_depth = compiler->codegen_table.get_nesting_level();
+
+  Value* frame = compiler->codegen_table.lookup_var("$frame");
+  Value* parent_frame = nullptr;
+  std::vector<Value*> vars;
+
+  if (callee_nesting_level <= current_depth) {
+    // The callee is declared in an enclosing scope so we find the frame of the function of its level
+    // that encloses us (or is us) and pass it as it is when it holds the same variables
+    auto owner = compiler->codegen_table.get_current_fun();
+    frame = enclosing_frame(frame, owner, callee_nesting_level);
+
+    if (same_frame(owner, callee))
+      return frame;
+
+    if (callee->has_parent_frame()) {
+      parent_frame = compiler->Builder.CreateStructGEP(frame, 0);
+      parent_frame = compiler->Builder.CreateLoad(parent_frame);
+    }
+
+    for (auto& var : callee->get_frame_vars()) {
+      Value* v = compiler->Builder.CreateStructGEP(frame, owner->frame_position(var));
+      vars.push_back(compiler->Builder.CreateLoad(v));
+    }
+  } else {
+    // If callee is in a deeper scope we send our local variables that it captures
+    if (callee->has_parent_frame())
+      parent_frame = frame;
+
+    for (auto& var : callee->get_frame_vars())
+      vars.push_back(compiler->codegen_table.lookup_var(var->get_name()));
+  }
 
-Value* String::codegen() {
-  return Builder.CreateGlobalStringPtr(this->val);
-}
+  Value* new_frame = temporary_alloca(st, "new_frame");
 
-Value* Nil::codegen() {
-  auto ptr = std::static_pointer_cast<PtrType>(this->type);
-  auto subtype = ptr->get_subtype();
-  Value* ptr_null = ConstantPointerNull::get(to_llvm_type(subtype)->getPointerTo());
+  int position = 0;
+  if (parent_frame)
+    compiler->Builder.CreateStore(parent_frame, compiler->Builder.CreateStructGEP(new_frame, position++));
 
-  Value* ptr_to_ptr = Builder.CreateAlloca(ptr_null->getType(), nullptr, "nil");
-  Builder.CreateStore(ptr_null, ptr_to_ptr);
+  for (auto& var : vars)
+    compiler->Builder.CreateStore(var, compiler->Builder.CreateStructGEP(new_frame, position++));
 
-  return ptr_to_ptr;
+  return new_frame;
 }
 
-Value* Variable::codegen() {
-  return codegen_table.lookup_var(this->name);
+// The code that follows a return never runs but is still generated, in a block nothing jumps to
+static void after_return() {
+  Function* TheFunction = compiler->Builder.GetInsertBlock()->getParent();
+
+  compiler->Builder.SetInsertPoint(BasicBlock::Create(*compiler->TheContext, "after_return", TheFunction));
 }
 
-Value* Array::codegen() {
-  Value* arr = this->arr->codegen();
-  Value* index = this->index->codegen();
+// The caller can only give up its stack before a call if no argument points to an alloca of it,
+// or to one of its arrays on the heap that are freed along with it
+static bool reaches_caller_stack(const std::vector<Value*>& args) {
+  auto& heap_arrays = compiler->codegen_table.get_heap_arrays();
 
-  index = (index->getType()->isPointerTy()) ? Builder.CreateLoad(index) : index;
+  for (auto& arg : args) {
+    Value* base = arg->stripInBoundsOffsets();
 
-  PointerType* pt = dyn_cast<PointerType>(arr->getType());
-  if (pt) {
-    if (pt->getElementType()->isArrayTy()) {
-      return Builder.CreateInBoundsGEP(arr, std::vector<Value*>{c32(0), index}, "array_gep");
-    } else {
-      return Builder.CreateInBoundsGEP(arr, index, "iarray_gep");
-    }
-  } else {
-    return nullptr;
+    if (isa<AllocaInst>(base) || std::find(heap_arrays.begin(), heap_arrays.end(), base) != heap_arrays.end())
+      return true;
   }
-}
-
-Value* Deref::codegen() {
-  return Builder.CreateLoad(this->ptr->codegen());
-}
 
-// Allocate and return pointer to the variable so that
-// when it's loaded we get the address of the variable
-Value* AddressOf::codegen() {
-  Value* var = this->var->codegen();
-  AllocaInst* ptr = Builder.CreateAlloca(var->getType(), nullptr, "pointer");
-  Builder.CreateStore(var, ptr, false);
-  return ptr;
+  return false;
 }
 
-// Helper function for the two call nodes
-Value* call_codegen(std::string& fun_name, std::vector<expr_ptr>& call_parameters, int line) {
-  auto fun_def = codegen_table.lookup_fun(fun_name);
-  auto prev_scope_vars = fun_def->get_prev_scope_vars();
-  auto fun_parameters = fun_def->get_parameters();
-  auto callee_nesting_level = fun_def->get_nesting_level();
-  auto is_lib_fun = fun_def->is_lib_fun();
-
-  Function* F = fun_def->get_function();
+// A recursive call in tail position stores its arguments over the ones of the running call and jumps
+// back to the start of the function, keeping the frame and the lifted variables it would pass unchanged
+static Value* tail_recursion(std::shared_ptr<FunDef>& fun_def, std::vector<Value*>& args, size_t mark) {
+  auto& arguments = compiler->codegen_table.get_arguments();
+  unsigned first = fun_def->get_frame_type() ? 1 : 0;
 
-  std::vector<Value*> ArgsV;
+  for (size_t i = 0; i < arguments.size(); i++)
+    compiler->Builder.CreateStore(args[first + i], arguments[i]);
 
-  if (!is_lib_fun) {
-    Value* prev_frame = codegen_table.lookup_var("$frame");
-    if (!prev_frame) {
-      StructType* st = StructType::get(TheContext, std::vector<Type*>());
-      prev_frame = Builder.CreateAlloca(st, nullptr, "prev_frame");
-    }
+  end_temporaries(mark);
+  compiler->Builder.CreateBr(compiler->codegen_table.lookup_label("$tail_recursion"));
+  after_return();
 
-    std::vector<Type*> types;
-    Value* new_frame = nullptr;
+  Type* ret_type = fun_def->get_return_type();
+  return ret_type->isVoidTy() ? nullptr : UndefValue::get(ret_type);
+}
 
-    int current_depth = codegen_table.get_nesting_level();
-    if (current_depth > callee_nesting_level) {
-      // If callee is in a previous scope, we pop the scopes that are not visible to it
-      int callee_nesting_difference = current_depth - callee_nesting_level;
+// Any other call in tail position returns its value right away and is marked tail, or musttail when the
+// prototypes match so that the callee replaces the caller on the stack even without optimizations
+static Value* tail_call(CallInst* call) {
+  Function* TheFunction = compiler->Builder.GetInsertBlock()->getParent();
 
-      for (int i = 0; i < callee_nesting_difference; i++) {
-        new_frame = Builder.CreateStructGEP(prev_frame, 0);
-        new_frame = Builder.CreateLoad(prev_frame);
-      }
-    } else if (current_depth == callee_nesting_level) {
-      // If callee is in the same depth we keep only the variables visible to the callee
-      Function* this_function = Builder.GetInsertBlock()->getParent();
-      std::string current_function = codegen_table.reverse_lookup_fun(this_function);
+  // The callee can't reach the arrays of the function on the heap, so they are freed before the call
+  IRBuilder<> builder(call);
+  free_heap_arrays(builder);
 
-      if (current_function == fun_name) {
-        new_frame = prev_frame;
-      } else {
-        Value* parent_frame = Builder.CreateStructGEP(prev_frame, 0);
-        parent_frame = Builder.CreateLoad(parent_frame);
+  call->setTailCall();
+  if (call->getFunctionType() == TheFunction->getFunctionType() &&
+      call->getCallingConv() == TheFunction->getCallingConv())
+    call->setTailCallKind(CallInst::TCK_MustTail);
 
-        types.push_back(parent_frame->getType());
+  if (TheFunction->getReturnType()->isVoidTy())
+    compiler->Builder.CreateRetVoid();
+  else
+    compiler->Builder.CreateRet(call);
 
-        for (auto& var : prev_scope_vars) {
-          if (var->get_nesting_level() == callee_nesting_level - 1) {
-            Type* var_type = to_llvm_type(var->get_type());
+  after_return();
 
-            if (!var_type->isPointerTy())
-              var_type = var_type->getPointerTo();
+  return call;
+}
 
-            types.push_back(var_type);
-          }
-        }
+// The math and conversion functions of the library are generated inline as intrinsics, casts and selects so that
+// the optimizer can fold, hoist and vectorize them, the ones of libpcl.c are only called for the rest
+static Value* builtin_codegen(const std::string& fun_name, std::vector<Value*>& args) {
+  auto& Builder = compiler->Builder;
 
-        StructType* st = StructType::get(TheContext, types);
-        new_frame = Builder.CreateAlloca(st, nullptr, "new_frame");
-
-        Value* first_pos = Builder.CreateStructGEP(new_frame, 0);
-        Builder.CreateStore(parent_frame, first_pos);
-
-        auto my_vars = codegen_table.lookup_fun(current_function)->get_prev_scope_vars();
-        int i = 0;
-        for (auto& my_var : my_vars) {
-          int j = 0;
-          for (auto& callee_var : prev_scope_vars) {
-            if (callee_var->get_name() == my_var->get_name()) {
-              Value* new_v = Builder.CreateStructGEP(new_frame, j + 1);
-              Value* old_v = Builder.CreateStructGEP(prev_frame, i + 1);
-              old_v = Builder.CreateLoad(old_v);
-
-              Builder.CreateStore(old_v, new_v);
-              break;
-            }
-            j++;
-          }
-          i++;
-        }
-      }
-    } else {
-      // If callee is in a deeper scope we send our local variables that are visible to it
-      types.push_back(prev_frame->getType());
+  if (fun_name == "abs") {
+    Value* negative = Builder.CreateICmpSLT(args[0], c32(0), "negative");
+    return Builder.CreateSelect(negative, Builder.CreateNeg(args[0], "neg"), args[0], "abs");
+  }
 
-      for (auto& var : prev_scope_vars) {
-        if (var->get_nesting_level() == callee_nesting_level - 1) {
-          Type* var_type = to_llvm_type(var->get_type());
+  if (fun_name == "fabs")
+    return Builder.CreateUnaryIntrinsic(Intrinsic::fabs, args[0]);
+  if (fun_name == "sqrt")
+    return Builder.CreateUnaryIntrinsic(Intrinsic::sqrt, args[0]);
+  if (fun_name == "sin")
+    return Builder.CreateUnaryIntrinsic(Intrinsic::sin, args[0]);
+  if (fun_name == "cos")
+    return Builder.CreateUnaryIntrinsic(Intrinsic::cos, args[0]);
+  if (fun_name == "exp")
+    return Builder.CreateUnaryIntrinsic(Intrinsic::exp, args[0]);
+  if (fun_name == "ln")
+    return Builder.CreateUnaryIntrinsic(Intrinsic::log, args[0]);
+  if (fun_name == "pi")
+    return ConstantFP::get(compiler->f64, M_PI);
+
+  // There's no intrinsic for the arc tangent but the optimizer knows atan of the C math library
+  if (fun_name == "arctan")
+    return Builder.CreateCall(compiler->codegen_table.lookup_fun("$atan")->get_function(), args);
+
+  // fptosi rounds towards zero, round rounds half way cases away from zero like the C function
+  if (fun_name == "trunc")
+    return Builder.CreateFPToSI(args[0], compiler->i32, "trunc");
+  if (fun_name == "round")
+    return Builder.CreateFPToSI(Builder.CreateUnaryIntrinsic(Intrinsic::round, args[0]), compiler->i32, "round");
+
+  if (fun_name == "ord")
+    return Builder.CreateSExt(args[0], compiler->i32, "ord");
+  if (fun_name == "chr")
+    return Builder.CreateTrunc(args[0], compiler->i8, "chr");
 
-          if (!var_type->isPointerTy())
-            var_type = var_type->getPointerTo();
+  return nullptr;
+}
 
-          types.push_back(var_type);
-        }
-      }
+// Helper function for the two call nodes
+// A call in tail position is followed by the return of the caller, with its value if the caller is a function
+Value* call_codegen(std::string& fun_name, std::vector<expr_ptr>& call_parameters, int line, bool tail) {
+  size_t mark = compiler->temporaries.size();
 
-      StructType* st = StructType::get(TheContext, types);
-      new_frame = Builder.CreateAlloca(st, nullptr, "new_frame");
-    
-      Value* first_pos = Builder.CreateStructGEP(new_frame, 0);
-      Builder.CreateStore(prev_frame, first_pos);
+  auto fun_def = compiler->codegen_table.lookup_fun(fun_name);
+  auto fun_parameters = fun_def->get_parameters();
 
-      int position = 1;
-      for (auto& var : prev_scope_vars) {
-        if (var->get_nesting_level() == callee_nesting_level - 1) {
-          Value* current_position = Builder.CreateStructGEP(new_frame, position);
-          Value* local_var = codegen_table.lookup_var(var->get_name());
+  Function* F = fun_def->get_function();
 
-          Builder.CreateStore(local_var, current_position);
+  std::vector<Value*> ArgsV;
 
-          position++;
-        }
-      }
-    }
-    
-    ArgsV.push_back(new_frame);
-  }
+  // Functions that capture nothing don't take a frame
+  if (!fun_def->is_lib_fun() && fun_def->get_frame_type())
+    ArgsV.push_back(callee_frame(fun_def));
 
   // Add the caller arguments right after the frame
   int call_param_count = call_parameters.size();
+  std::vector<Value*> lengths;
 
   for (int i = 0; i < call_param_count; i++) {
     bool pass_by_reference = fun_parameters[i];
 
-    Value* v = call_parameters[i]->codegen();
     if (pass_by_reference) {
-      if (!v->getType()->isPointerTy()) {
-        std::cerr << "Line: " << line << " Error: Pass by reference requires an l-value" << std::endl;
-        exit(1);
+      Value* v = call_parameters[i]->codegen_address();
+      if (!v)
+        error("Pass by reference requires an l-value", line);
+
+      // With bounds checks the arrays of unknown size are followed by their length, which is only
+      // checked against negative indices when we don't know it
+      if (compiler->bounds_check && !fun_def->is_lib_fun() && fun_def->get_open_arrays()[i]) {
+        Value* length = array_length(call_parameters[i].get());
+        lengths.push_back(length ? length : c32(INT_MAX));
       }
 
       PointerType* pt = cast<PointerType>(v->getType());
       if (pt->getElementType()->isArrayTy())
-        v = Builder.CreateInBoundsGEP(v, std::vector<Value*>{c32(0), c32(0)}, "array_gep");
+        v = compiler->Builder.CreateInBoundsGEP(v, std::vector<Value*>{c32(0), c32(0)}, "array_gep");
 
       ArgsV.push_back(v);
     } else {
-      v = (v->getType()->isPointerTy()) ? Builder.CreateLoad(v) : v;
-      ArgsV.push_back(v);
+      Value* v = call_parameters[i]->codegen_value();
+      ArgsV.push_back(convert_pointer(v, F->getFunctionType()->getParamType(ArgsV.size())));
     }
   }
 
-  return Builder.CreateCall(F, ArgsV);
-}
+  ArgsV.insert(ArgsV.end(), lengths.begin(), lengths.end());
+
+  // The captured variables the callee only reads are passed by value after them,
+  // either our own locals or variables we capture too
+  for (auto& var : fun_def->get_lifted_vars()) {
+    Value* v = (var->get_nesting_level() == compiler->codegen_table.get_nesting_level())
+      ? compiler->codegen_table.lookup_var(var->get_name())
+      : compiler->codegen_table.lookup_captured_var(var->get_nesting_level(), var->get_name());
+
+    ArgsV.push_back(compiler->Builder.CreateLoad(v));
+  }
 
-Value* CallExpr::codegen() {
-  auto fun_def = codegen_table.lookup_fun(this->fun_name);
+  if (fun_def->is_lib_fun())
+    if (Value* v = builtin_codegen(fun_name, ArgsV))
+      return v;
 
-  Value* temp_res = Builder.CreateAlloca(fun_def->get_return_type(), nullptr);
-  Value* call_res = call_codegen(this->fun_name, this->parameters, this->get_line());
-  Builder.CreateStore(call_res, temp_res);
+  if (!tail || reaches_caller_stack(ArgsV))
+    return compiler->Builder.CreateCall(F, ArgsV);
 
-  return temp_res;
+  if (fun_def == compiler->codegen_table.get_current_fun() && compiler->codegen_table.lookup_label("$tail_recursion"))
+    return tail_recursion(fun_def, ArgsV, mark);
+
+  // With a display the caller still has to restore the record it replaced after the call
+  CallInst* call = compiler->Builder.CreateCall(F, ArgsV);
+  Type* ret_type = compiler->codegen_table.get_current_fun()->get_return_type();
+
+  if (compiler->codegen_table.lookup_var("$record") || !(ret_type->isVoidTy() || ret_type == call->getType()))
+    return call;
+
+  return tail_call(call);
 }
 
-Value* Result::codegen() {
-  return codegen_table.lookup_var("result");
+Value* CallExpr::codegen_value() {
+  return call_codegen(this->fun_name, this->parameters, this->get_line(), this->tail);
 }
 
-Value* BinaryExpr::codegen() {
-  Value* left = this->left->codegen();
+Value* Result::codegen_value() {
+  return compiler->Builder.CreateLoad(this->codegen_address());
+}
 
-  // AND,OR operations are shortcircuited and the right operand is
-  // only evaluated if the result is not known from the left operand
-  Value* right;
-  if (this->op != BinOp::AND && this->op != BinOp::OR)
-    right = this->right->codegen();
+Value* Result::codegen_address() {
+  return compiler->codegen_table.lookup_var("result");
+}
 
-  // If pointers to value load the value
-  left = (left->getType()->isPointerTy()) ? Builder.CreateLoad(left) : left;
-  if (this->op != BinOp::AND && this->op != BinOp::OR)
-    right = (right->getType()->isPointerTy()) ? Builder.CreateLoad(right) : right;
+// Evaluate both operands, converting an integer to real when the other one is real
+void BinaryExpr::codegen_operands(Value*& left, Value*& right) {
+  left = this->left->codegen_value();
+  right = this->right->codegen_value();
 
   auto left_type = this->left->get_type();
   auto right_type = this->right->get_type();
 
   if (left_type->is(BasicType::Integer)
       && right_type->is(BasicType::Real))
-    left = Builder.CreateSIToFP(left, f64, "sitofp");
+    left = compiler->Builder.CreateSIToFP(left, compiler->f64, "sitofp");
 
   if (left_type->is(BasicType::Real)
       && right_type->is(BasicType::Integer))
-    right = Builder.CreateSIToFP(right, f64, "sitofp");
-
-  switch(this->op) {
-    case BinOp::PLUS:
-      if (this->type->is(BasicType::Integer))
-        return Builder.CreateAdd(left, right, "add_int");
-      else
-        return Builder.CreateFAdd(left, right, "add_real");
-
-    case BinOp::MINUS:
-      if (this->type->is(BasicType::Integer))
-        return Builder.CreateSub(left, right, "sub_int");
-      else
-        return Builder.CreateFSub(left, right, "sub_real");
-
-    case BinOp::MUL:
-      if (this->type->is(BasicType::Integer))
-        return Builder.CreateMul(left, right, "mul_int");
-      else
-        return Builder.CreateFMul(left, right, "mul_real");
-
-    case BinOp::DIV:
-      if (left_type->is(BasicType::Integer))
-        left = Builder.CreateSIToFP(left, f64, "sitofp");
+    right = compiler->Builder.CreateSIToFP(right, compiler->f64, "sitofp");
+}
 
-      if (right_type->is(BasicType::Integer))
-        right = Builder.CreateSIToFP(right, f64, "sitofp");
+// The i1 result of a comparison operator
+Value* BinaryExpr::codegen_comparison(Value* left, Value* right) {
+  bool real = left->getType()->isDoubleTy();
 
-      return Builder.CreateFDiv(left, right, "div_real");
+  // Pointers are compared by address, without the length of the array they may come with
+  if (left->getType()->isStructTy())
+    left = compiler->Builder.CreateExtractValue(left, 0);
 
-    case BinOp::INT_DIV:
-      return Builder.CreateSDiv(left, right, "div_int");
+  if (right->getType()->isStructTy())
+    right = compiler->Builder.CreateExtractValue(right, 0);
 
-    case BinOp::MOD:
-      return Builder.CreateSRem(left, right, "mod_int");
+  if (left->getType()->isPointerTy() && right->getType()->isPointerTy()) {
+    left = compiler->Builder.CreatePtrToInt(left, Type::getInt64Ty(*compiler->TheContext));
+    right = compiler->Builder.CreatePtrToInt(right, Type::getInt64Ty(*compiler->TheContext));
+  }
 
+  switch(this->op) {
     case BinOp::EQ:
-    {
-      Value* cmp_res;
-      if (left_type->is(BasicType::Real)) {
-        cmp_res = Builder.CreateFCmpUEQ(left, right, "fcmp_eq");
-      } else if (left->getType()->isPointerTy() && right->getType()->isPointerTy()) {
-        left = Builder.CreatePtrToInt(left, Type::getInt64Ty(TheContext));
-        right = Builder.CreatePtrToInt(right, Type::getInt64Ty(TheContext));
-        cmp_res = Builder.CreateICmpEQ(left, right, "icmp_eq");
-      } else {
-        cmp_res = Builder.CreateICmpEQ(left, right, "icmp_eq");
-      }
-
-      return Builder.CreateZExt(cmp_res, i8);
-    }
+      if (real)
+        return compiler->Builder.CreateFCmpUEQ(left, right, "fcmp_eq");
+      else
+        return compiler->Builder.CreateICmpEQ(left, right, "icmp_eq");
 
     case BinOp::NE:
-    {
-      Value* cmp_res;
-      if (left_type->is(BasicType::Real)) {
-        cmp_res = Builder.CreateFCmpUNE(left, right, "fcmp_ne");
-      } else if (left->getType()->isPointerTy() && right->getType()->isPointerTy()) {
-        left = Builder.CreatePtrToInt(left, Type::getInt64Ty(TheContext));
-        right = Builder.CreatePtrToInt(right, Type::getInt64Ty(TheContext));
-        cmp_res = Builder.CreateICmpNE(left, right, "icmp_ne");
-      } else {
-        cmp_res = Builder.CreateICmpNE(left, right, "icmp_ne");
-      }
-  
-      return Builder.CreateZExt(cmp_res, i8);
-    }
+      if (real)
+        return compiler->Builder.CreateFCmpUNE(left, right, "fcmp_ne");
+      else
+        return compiler->Builder.CreateICmpNE(left, right, "icmp_ne");
 
     case BinOp::LT:
-    {
-      Value* cmp_res;
-      if (left_type->is(BasicType::Real))
-        cmp_res = Builder.CreateFCmpULT(left, right, "fcmp_lt");
+      if (real)
+        return compiler->Builder.CreateFCmpULT(left, right, "fcmp_lt");
       else
-        cmp_res = Builder.CreateICmpSLT(left, right, "icmp_lt");
-
-      return Builder.CreateZExt(cmp_res, i8);
-    }
+        return compiler->Builder.CreateICmpSLT(left, right, "icmp_lt");
 
     case BinOp::GT:
-    {
-      Value* cmp_res;
-      if(left_type->is(BasicType::Real))
-        cmp_res = Builder.CreateFCmpUGT(left, right, "fcmp_gt");
+      if (real)
+        return compiler->Builder.CreateFCmpUGT(left, right, "fcmp_gt");
       else
-        cmp_res = Builder.CreateICmpSGT(left, right, "icmp_gt");
-
-      return Builder.CreateZExt(cmp_res, i8);
-    }
+        return compiler->Builder.CreateICmpSGT(left, right, "icmp_gt");
 
     case BinOp::LE:
-    {
-      Value* cmp_res;
-      if(left_type->is(BasicType::Real))
-        cmp_res = Builder.CreateFCmpULE(left, right, "fcmp_le");
+      if (real)
+        return compiler->Builder.CreateFCmpULE(left, right, "fcmp_le");
       else
-        cmp_res = Builder.CreateICmpSLE(left, right, "icmp_le");
-
-      return Builder.CreateZExt(cmp_res, i8);
-    }
+        return compiler->Builder.CreateICmpSLE(left, right, "icmp_le");
 
     case BinOp::GE:
-    {
-      Value* cmp_res;
-      if(left_type->is(BasicType::Real))
-        cmp_res = Builder.CreateFCmpUGE(left, right, "fcmp_ge");
+      if (real)
+        return compiler->Builder.CreateFCmpUGE(left, right, "fcmp_ge");
       else
-        cmp_res = Builder.CreateICmpSGE(left, right, "icmp_ge");
+        return compiler->Builder.CreateICmpSGE(left, right, "icmp_ge");
 
-      return Builder.CreateZExt(cmp_res, i8);
-    }
+    default:
+      return nullptr;
+  }
+}
 
-    case BinOp::AND:
-    {
-      // And is shortcircuited so evaluate the first operand and if it's false
-      // then skip evaluating the second one
-      Value* res = Builder.CreateAlloca(i8, nullptr, "and_res");
+Value* BinaryExpr::codegen_value() {
+  // AND,OR operations are shortcircuited and the right operand is only evaluated if the result
+  // is not known from the left operand, in which case the result is the right operand
+  if (this->op == BinOp::AND || this->op == BinOp::OR) {
+    bool is_and = this->op == BinOp::AND;
 
-      Value* cmp_res = Builder.CreateICmpEQ(left, c8(false), "icmp_eq");
+    Value* left = this->left->codegen_value();
+    BasicBlock* LeftBB = compiler->Builder.GetInsertBlock();
+    Function* TheFunction = LeftBB->getParent();
 
-      Function* TheFunction = Builder.GetInsertBlock()->getParent();
+    BasicBlock* RightBB = BasicBlock::Create(*compiler->TheContext, is_and ? "and_right_operand" : "or_right_operand",
+                                             TheFunction);
+    BasicBlock* AfterBB = BasicBlock::Create(*compiler->TheContext, "after");
 
-      BasicBlock* FalseBB = BasicBlock::Create(TheContext, "and_false", TheFunction);
-      BasicBlock* ElseBB = BasicBlock::Create(TheContext, "and_right_operand");
-      BasicBlock* AfterBB = BasicBlock::Create(TheContext, "after");
+    Value* cmp_res = compiler->Builder.CreateICmpNE(left, c8(false), "icmp_ne");
+    if (is_and)
+      compiler->Builder.CreateCondBr(cmp_res, RightBB, AfterBB);
+    else
+      compiler->Builder.CreateCondBr(cmp_res, AfterBB, RightBB);
 
-      Builder.CreateCondBr(cmp_res, FalseBB, ElseBB);
+    compiler->Builder.SetInsertPoint(RightBB);
+    Value* right = this->right->codegen_value();
+    RightBB = compiler->Builder.GetInsertBlock();
+    compiler->Builder.CreateBr(AfterBB);
 
-      Builder.SetInsertPoint(FalseBB);
-      Builder.CreateStore(c8(false), res);
-      Builder.CreateBr(AfterBB);
+    TheFunction->getBasicBlockList().push_back(AfterBB);
+    compiler->Builder.SetInsertPoint(AfterBB);
 
-      TheFunction->getBasicBlockList().push_back(ElseBB);
-      Builder.SetInsertPoint(ElseBB);
+    PHINode* phi = compiler->Builder.CreatePHI(compiler->i8, 2, is_and ? "and_res" : "or_res");
+    phi->addIncoming(c8(!is_and), LeftBB);
+    phi->addIncoming(right, RightBB);
 
-      right = this->right->codegen();
-      right = (right->getType()->isPointerTy()) ? Builder.CreateLoad(right) : right;
+    return phi;
+  }
 
-      Value* right_operand = Builder.CreateICmpEQ(right, c8(true), "icmp_eq");
-      right_operand = Builder.CreateZExt(right_operand, i8);
+  Value* left;
+  Value* right;
+  this->codegen_operands(left, right);
 
-      Builder.CreateStore(right_operand, res);
-      Builder.CreateBr(AfterBB);
+  auto left_type = this->left->get_type();
+  auto right_type = this->right->get_type();
 
-      TheFunction->getBasicBlockList().push_back(AfterBB);
-      Builder.SetInsertPoint(AfterBB);
+  switch(this->op) {
+    case BinOp::PLUS:
+      if (this->type->is(BasicType::Integer))
+        return compiler->Builder.CreateAdd(left, right, "add_int");
+      else
+        return compiler->Builder.CreateFAdd(left, right, "add_real");
 
-      return res;
-    }
+    case BinOp::MINUS:
+      if (this->type->is(BasicType::Integer))
+        return compiler->Builder.CreateSub(left, right, "sub_int");
+      else
+        return compiler->Builder.CreateFSub(left, right, "sub_real");
 
-    case BinOp::OR:
-    {
-      // Or is shortcircuited so evaluate the first operand and if it's true
-      // then skip evaluating the second one
-      Value* res = Builder.CreateAlloca(i8, nullptr, "or_res");
+    case BinOp::MUL:
+      if (this->type->is(BasicType::Integer))
+        return compiler->Builder.CreateMul(left, right, "mul_int");
+      else
+        return compiler->Builder.CreateFMul(left, right, "mul_real");
+
+    case BinOp::DIV:
+      if (left_type->is(BasicType::Integer))
+        left = compiler->Builder.CreateSIToFP(left, compiler->f64, "sitofp");
+
+      if (right_type->is(BasicType::Integer))
+        right = compiler->Builder.CreateSIToFP(right, compiler->f64, "sitofp");
 
-      Value* cmp_res = Builder.CreateICmpEQ(left, c8(true), "icmp_eq");
+      return compiler->Builder.CreateFDiv(left, right, "div_real");
 
-      Function* TheFunction = Builder.GetInsertBlock()->getParent();
+    case BinOp::INT_DIV:
+      return compiler->Builder.CreateSDiv(left, right, "div_int");
 
-      BasicBlock* TrueBB = BasicBlock::Create(TheContext, "or_true", TheFunction);
-      BasicBlock* ElseBB = BasicBlock::Create(TheContext, "or_right_operand");
-      BasicBlock* AfterBB = BasicBlock::Create(TheContext, "after");
+    case BinOp::MOD:
+      return compiler->Builder.CreateSRem(left, right, "mod_int");
 
-      Builder.CreateCondBr(cmp_res, TrueBB, ElseBB);
+    case BinOp::EQ:
+    case BinOp::NE:
+    case BinOp::LT:
+    case BinOp::GT:
+    case BinOp::LE:
+    case BinOp::GE:
+      return compiler->Builder.CreateZExt(this->codegen_comparison(left, right), compiler->i8);
 
-      Builder.SetInsertPoint(TrueBB);
-      Builder.CreateStore(c8(true), res);
-      Builder.CreateBr(AfterBB);
+    default:
+      return nullptr;
+  }
+}
 
-      TheFunction->getBasicBlockList().push_back(ElseBB);
-      Builder.SetInsertPoint(ElseBB);
+// In a condition AND,OR jump straight to the targets once the result is known
+// and comparisons branch on their i1 result
+void BinaryExpr::codegen_branch(BasicBlock* true_block, BasicBlock* false_block) {
+  if (this->op == BinOp::AND || this->op == BinOp::OR) {
+    Function* TheFunction = compiler->Builder.GetInsertBlock()->getParent();
+    BasicBlock* RightBB = BasicBlock::Create(*compiler->TheContext,
+                                             this->op == BinOp::AND ? "and_right_operand" : "or_right_operand");
 
-      right = this->right->codegen();
-      right = (right->getType()->isPointerTy()) ? Builder.CreateLoad(right) : right;
+    if (this->op == BinOp::AND)
+      this->left->codegen_branch(RightBB, false_block);
+    else
+      this->left->codegen_branch(true_block, RightBB);
 
-      Value* right_operand = Builder.CreateICmpEQ(right, c8(true), "icmp_eq");
-      right_operand = Builder.CreateZExt(right_operand, i8);
+    TheFunction->getBasicBlockList().push_back(RightBB);
+    compiler->Builder.SetInsertPoint(RightBB);
+    this->right->codegen_branch(true_block, false_block);
 
-      Builder.CreateStore(right_operand, res);
-      Builder.CreateBr(AfterBB);
+    return;
+  }
 
-      TheFunction->getBasicBlockList().push_back(AfterBB);
-      Builder.SetInsertPoint(AfterBB);
+  Value* cmp_res = nullptr;
+  size_t mark = compiler->temporaries.size();
 
-      return res;
+  switch(this->op) {
+    case BinOp::EQ:
+    case BinOp::NE:
+    case BinOp::LT:
+    case BinOp::GT:
+    case BinOp::LE:
+    case BinOp::GE:
+    {
+      Value* left;
+      Value* right;
+      this->codegen_operands(left, right);
+      cmp_res = this->codegen_comparison(left, right);
+      break;
     }
 
     default:
-      return nullptr;
+      cmp_res = compiler->Builder.CreateICmpNE(this->codegen_value(), c8(false), "cond");
   }
+
+  end_temporaries(mark);
+  compiler->Builder.CreateCondBr(cmp_res, true_block, false_block);
 }
 
-Value* UnaryExpr::codegen() {
-  Value* operand = this->operand->codegen();
-  operand = (operand->getType()->isPointerTy()) ? Builder.CreateLoad(operand) : operand;
+Value* UnaryExpr::codegen_value() {
+  Value* operand = this->operand->codegen_value();
 
   switch(this->op) {
     case UnOp::PLUS:
@@ -1820,14 +3071,14 @@ Value* UnaryExpr::codegen() {
 
     case UnOp::MINUS:
       if (this->type->is(BasicType::Integer))
-        return Builder.CreateNeg(operand, "neg");
+        return compiler->Builder.CreateNeg(operand, "neg");
       else
-        return Builder.CreateFNeg(operand, "fneg");
+        return compiler->Builder.CreateFNeg(operand, "fneg");
 
     case UnOp::NOT: {
-      operand = Builder.CreateIntCast(operand, Type::getInt1Ty(TheContext), true);
-      Value* temp = Builder.CreateNot(operand, "neg");
-      return Builder.CreateZExt(temp, i8);
+      operand = compiler->Builder.CreateIntCast(operand, Type::getInt1Ty(*compiler->TheContext), true);
+      Value* temp = compiler->Builder.CreateNot(operand, "neg");
+      return compiler->Builder.CreateZExt(temp, compiler->i8);
     }
 
     default:
@@ -1835,23 +3086,67 @@ Value* UnaryExpr::codegen() {
   }
 }
 
+void UnaryExpr::codegen_branch(BasicBlock* true_block, BasicBlock* false_block) {
+  if (this->op == UnOp::NOT)
+    this->operand->codegen_branch(false_block, true_block);
+  else
+    Expr::codegen_branch(true_block, false_block);
+}
+
 Value* Empty::codegen() {
   return nullptr;
 }
 
+// Generate a statement and end the lifetime of the temporaries it created
+static void codegen_statement(const stmt_ptr& stmt) {
+  size_t mark = compiler->temporaries.size();
+
+  stmt->codegen();
+  end_temporaries(mark);
+}
+
 Value* Block::codegen() {
   for (auto& stmt : stmt_list)
-    stmt->codegen();
+    codegen_statement(stmt);
 
   return nullptr;
 }
 
 Value* VarNames::codegen() {
   Type* type = to_llvm_type(this->type);
+
+  // main is never reentered so the variables of the program live in internal globals
+  if (compiler->codegen_table.get_nesting_level() == 1) {
+    for (auto& name : this->names) {
+      GlobalVariable* global = new GlobalVariable(*compiler->TheModule, type, false, GlobalValue::InternalLinkage,
+                                                  Constant::getNullValue(type), name);
+
+      compiler->codegen_table.insert_global_var(name, global);
+    }
+
+    return nullptr;
+  }
+
+  // Arrays larger than the limit would overflow the stack, so they are static in the functions that are never
+  // reentered and allocated on the heap when the function starts in the others
+  const DataLayout& DL = compiler->TheModule->getDataLayout();
+  bool large = type->isArrayTy() && DL.getTypeAllocSize(type) > compiler->max_stack_array;
+  auto fun_def = compiler->codegen_table.get_current_fun();
+
   for (auto& name : this->names) {
-    AllocaInst* alloca = Builder.CreateAlloca(type, nullptr, name);
+    Value* address;
+
+    if (!large) {
+      address = entry_alloca(type, name);
+    } else if (!fun_def->is_recursive()) {
+      address = new GlobalVariable(*compiler->TheModule, type, false, GlobalValue::InternalLinkage,
+                                   Constant::getNullValue(type), fun_def->get_function()->getName() + "." + name);
+    } else {
+      address = heap_array(type, name);
+    }
 
-    codegen_table.insert_var(name, alloca);
+    compiler->codegen_table.insert_var(name, address);
+    share_variable(name, address);
   }
 
   return nullptr;
@@ -1865,36 +3160,61 @@ Value* VarDecl::codegen() {
 }
 
 Value* LabelDecl::codegen() {
-  Function* TheFunction = Builder.GetInsertBlock()->getParent();
+  Function* TheFunction = compiler->Builder.GetInsertBlock()->getParent();
 
   for (auto& name : this->names) {
-    BasicBlock* LabelBB = BasicBlock::Create(TheContext, "label_" + name, TheFunction);
+    BasicBlock* LabelBB = BasicBlock::Create(*compiler->TheContext, "label_" + name, TheFunction);
 
-    codegen_table.insert_label(name, LabelBB);
+    compiler->codegen_table.insert_label(name, LabelBB);
   }
 
   return nullptr;
 }
 
+// Arrays are copied with a memcpy of as many elements as the smaller of the two holds, instead of a load
+// and a store of the whole aggregate that the code generator splits into one per element
+static void copy_array(const expr_ptr& left, const expr_ptr& right) {
+  Value* dst = left->codegen_address();
+  Value* src = right->codegen_address();
+
+  auto left_type = std::static_pointer_cast<ArrType>(left->get_type());
+  auto right_type = std::static_pointer_cast<ArrType>(right->get_type());
+  int length = std::min(left_type->get_size(), right_type->get_size());
+
+  const DataLayout& DL = compiler->TheModule->getDataLayout();
+  Type* element = to_llvm_type(left_type->get_subtype());
+  uint64_t size = DL.getTypeAllocSize(element);
+  size *= length;
+
+  MaybeAlign align(DL.getABITypeAlignment(element));
+  compiler->Builder.CreateMemCpy(dst, align, src, align, size);
+}
+
 Value* Assign::codegen() {
-  Value* left = this->left->codegen();
-  Value* right = this->right->codegen();
+  if (this->left->get_type()->is(BasicType::Array)) {
+    copy_array(this->left, this->right);
+    return nullptr;
+  }
+
+  Value* left = this->left->codegen_address();
+  Value* right = this->right->codegen_value();
 
-  right = (right->getType()->isPointerTy()) ? Builder.CreateLoad(right) : right;
-  Builder.CreateStore(right, left);
+  right = convert_pointer(right, cast<PointerType>(left->getType())->getElementType());
+
+  compiler->Builder.CreateStore(right, left);
   return nullptr;
 }
 
 Value* Goto::codegen() {
-  Builder.CreateBr(codegen_table.lookup_label(this->label));
+  compiler->Builder.CreateBr(compiler->codegen_table.lookup_label(this->label));
   return nullptr;
 }
 
 Value* Label::codegen() {
-  BasicBlock* LabelBB = codegen_table.lookup_label(this->label);
-  Builder.CreateBr(LabelBB);
+  BasicBlock* LabelBB = compiler->codegen_table.lookup_label(this->label);
+  compiler->Builder.CreateBr(LabelBB);
 
-  Builder.SetInsertPoint(LabelBB);
+  compiler->Builder.SetInsertPoint(LabelBB);
 
   this->stmt->codegen();
 
@@ -1902,63 +3222,56 @@ Value* Label::codegen() {
 }
 
 Value* If::codegen() {
-  Value* cond = this->cond->codegen();
-  cond = (cond->getType()->isPointerTy()) ? Builder.CreateLoad(cond) : cond;
-  Value* cmp_res = Builder.CreateICmpEQ(cond, c8(true), "if_cmp");
-
-  Function* TheFunction = Builder.GetInsertBlock()->getParent();
+  Function* TheFunction = compiler->Builder.GetInsertBlock()->getParent();
 
-  BasicBlock* ThenBB = BasicBlock::Create(TheContext, "then", TheFunction);
-  BasicBlock* ElseBB = BasicBlock::Create(TheContext, "else");
-  BasicBlock* AfterBB = BasicBlock::Create(TheContext, "after");
+  BasicBlock* ThenBB = BasicBlock::Create(*compiler->TheContext, "then");
+  BasicBlock* ElseBB = BasicBlock::Create(*compiler->TheContext, "else");
+  BasicBlock* AfterBB = BasicBlock::Create(*compiler->TheContext, "after");
 
-  Builder.CreateCondBr(cmp_res, ThenBB, ElseBB);
+  this->cond->codegen_branch(ThenBB, ElseBB);
 
-  Builder.SetInsertPoint(ThenBB);
-  this->if_stmt->codegen();
+  TheFunction->getBasicBlockList().push_back(ThenBB);
+  compiler->Builder.SetInsertPoint(ThenBB);
+  codegen_statement(this->if_stmt);
 
   // If a terminator instruction was already generated we skip the branch instruction
-  if (!Builder.GetInsertBlock()->getTerminator())
-    Builder.CreateBr(AfterBB);
+  if (!compiler->Builder.GetInsertBlock()->getTerminator())
+    compiler->Builder.CreateBr(AfterBB);
 
   TheFunction->getBasicBlockList().push_back(ElseBB);
-  Builder.SetInsertPoint(ElseBB);
+  compiler->Builder.SetInsertPoint(ElseBB);
   if (this->else_stmt)
-    this->else_stmt->codegen();
+    codegen_statement(this->else_stmt);
 
   // If a terminator instruction was already generated we skip the branch instruction
-  if (!Builder.GetInsertBlock()->getTerminator())
-    Builder.CreateBr(AfterBB);
+  if (!compiler->Builder.GetInsertBlock()->getTerminator())
+    compiler->Builder.CreateBr(AfterBB);
 
   TheFunction->getBasicBlockList().push_back(AfterBB);
-  Builder.SetInsertPoint(AfterBB);
+  compiler->Builder.SetInsertPoint(AfterBB);
 
   return nullptr;
 }
 
 Value* While::codegen() {
-  Function* TheFunction = Builder.GetInsertBlock()->getParent();
+  Function* TheFunction = compiler->Builder.GetInsertBlock()->getParent();
 
-  BasicBlock* LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
-  BasicBlock* BodyBB = BasicBlock::Create(TheContext, "body");
-  BasicBlock* AfterBB = BasicBlock::Create(TheContext, "after");
+  BasicBlock* LoopBB = BasicBlock::Create(*compiler->TheContext, "loop", TheFunction);
+  BasicBlock* BodyBB = BasicBlock::Create(*compiler->TheContext, "body");
+  BasicBlock* AfterBB = BasicBlock::Create(*compiler->TheContext, "after");
 
-  Builder.CreateBr(LoopBB);
-  Builder.SetInsertPoint(LoopBB);
+  compiler->Builder.CreateBr(LoopBB);
+  compiler->Builder.SetInsertPoint(LoopBB);
 
-  Value* cond = this->cond->codegen();
-  cond = (cond->getType()->isPointerTy()) ? Builder.CreateLoad(cond) : cond;
-  Value* cmp_res = Builder.CreateICmpEQ(cond, c8(true), "while_cmp");
-  
-  Builder.CreateCondBr(cmp_res, BodyBB, AfterBB);
+  this->cond->codegen_branch(BodyBB, AfterBB);
 
   TheFunction->getBasicBlockList().push_back(BodyBB);
-  Builder.SetInsertPoint(BodyBB);
-  this->body->codegen();
-  Builder.CreateBr(LoopBB);
+  compiler->Builder.SetInsertPoint(BodyBB);
+  codegen_statement(this->body);
+  compiler->Builder.CreateBr(LoopBB);
 
   TheFunction->getBasicBlockList().push_back(AfterBB);
-  Builder.SetInsertPoint(AfterBB);
+  compiler->Builder.SetInsertPoint(AfterBB);
 
   return nullptr;
 }
@@ -1977,38 +3290,42 @@ Value* Body::codegen() {
 }
 
 Value* Fun::codegen() {
-  BasicBlock* Parent = Builder.GetInsertBlock();
+  BasicBlock* Parent = compiler->Builder.GetInsertBlock();
 
-  auto ni = semantic_to_codegen[this->fun_name];
+  auto& ni = compiler->semantic_to_codegen[this->id];
   this->nesting_level = ni.nesting_level;
-  this->prev_scope_vars = ni.prev_scope_vars;
 
   // Create function only once
-  if (!codegen_table.current_scope_lookup_fun(this->fun_name)) {
+  if (!compiler->codegen_table.current_scope_lookup_fun(this->fun_name)) {
     std::vector<Type*> args;
 
-    // Collect previous scope variables and put them inside nested structs
-    std::vector<std::vector<Type*>> scope_types(this->nesting_level - 1, std::vector<Type*>());
+    // The function is generated in the scope of the function it is declared in
+    auto parent = compiler->codegen_table.get_current_fun();
 
-    for (auto& var : this->prev_scope_vars) {
-      Type* var_type = to_llvm_type(var->get_type());
-      if (!var_type->isPointerTy())
-        var_type = var_type->getPointerTo();
+    // The frame holds the frame of the parent when variables of outer scopes are captured
+    // and pointers to the captured variables of the parent
+    // With a display there are no frames and the captured variables are found through it
+    StructType* frame_type = nullptr;
+    if (!ni.captured_vars.empty() && !compiler->display) {
+      std::vector<Type*> types;
 
-      scope_types[var->get_nesting_level() - 1].push_back(var_type);
-    }
+      for (auto& var : ni.captured_vars) {
+        if (var->get_nesting_level() < this->nesting_level - 1) {
+          types.push_back(parent->get_frame_type()->getPointerTo());
+          break;
+        }
+      }
 
-    Type* current_st = StructType::get(TheContext)->getPointerTo();
-    for (auto& scope : scope_types) {
-      std::vector<Type*> types;
-      types.push_back(current_st);
-      types.insert(types.end(), scope.begin(), scope.end());
-      current_st = StructType::get(TheContext, types)->getPointerTo();
-    }
+      for (auto& var : ni.captured_vars)
+        if (var->get_nesting_level() == this->nesting_level - 1)
+          types.push_back(to_llvm_type(var->get_type())->getPointerTo());
 
-    args.push_back(current_st);
+      frame_type = StructType::get(*compiler->TheContext, types);
+      args.push_back(frame_type->getPointerTo());
+    }
 
     std::vector<bool> parameters;
+    std::vector<bool> open_arrays;
 
     for (auto& formal : this->formal_parameters) {
       for (auto& name : formal->get_names()) {
@@ -2019,132 +3336,205 @@ Value* Fun::codegen() {
 
         args.push_back(type);
         parameters.push_back(formal->get_pass_by_reference());
+        open_arrays.push_back(formal->get_type()->is(BasicType::IArray));
       }
     }
 
+    if (compiler->bounds_check)
+      for (bool open_array : open_arrays)
+        if (open_array)
+          args.push_back(compiler->i32);
+
+    for (auto& var : ni.lifted_vars)
+      args.push_back(to_llvm_type(var->get_type()));
+
     Type* ret_type = to_llvm_type(this->return_type);
 
     FunctionType* FT = FunctionType::get(ret_type, args, false);
-    Function* F = Function::Create(FT, Function::PrivateLinkage, this->fun_name, TheModule.get());
+    Function* F = Function::Create(FT, Function::PrivateLinkage, this->fun_name, compiler->TheModule.get());
 
-    auto fun_def = std::make_shared<FunDef>(ret_type, parameters, F, this->prev_scope_vars, this->nesting_level);
+    auto fun_def = std::make_shared<FunDef>(ret_type, parameters, F, parent, ni.captured_vars, frame_type,
+                                            this->nesting_level);
+    fun_def->set_shared_vars(ni.shared_vars);
+    fun_def->set_lifted_vars(ni.lifted_vars);
+    fun_def->set_open_arrays(open_arrays);
+    fun_def->set_recursive(ni.recursive);
 
-    codegen_table.insert_fun(this->fun_name, fun_def);
+    compiler->codegen_table.insert_fun(this->fun_name, fun_def);
   }
 
   // If not forward declaration generate code
   if (!this->forward_declaration) {
-    codegen_table.open_scope();
+    compiler->codegen_table.open_scope();
 
-    auto fun_def = codegen_table.lookup_fun(this->fun_name);
+    auto fun_def = compiler->codegen_table.lookup_fun(this->fun_name);
     Function* TheFunction = fun_def->get_function();
+    compiler->codegen_table.set_current_fun(fun_def);
 
-    BasicBlock* BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-    Builder.SetInsertPoint(BB);
+    BasicBlock* BB = BasicBlock::Create(*compiler->TheContext, "entry", TheFunction);
+    compiler->Builder.SetInsertPoint(BB);
 
     FunctionType* FT = TheFunction->getFunctionType();     
 
-    // Retrieve arguments
-    unsigned i = 1;
+    open_display_record(fun_def);
+
+    // Retrieve arguments, which follow the frame if there is one
+    unsigned i = fun_def->get_frame_type() ? 1 : 0;
     for (auto& formal : this->formal_parameters) {
       for (auto& name : formal->get_names()) {
         Type* type = FT->getParamType(i);
 
-        Value* alloca = Builder.CreateAlloca(type, nullptr, name);
-        Builder.CreateStore(TheFunction->getArg(i), alloca);
-        
-        if (formal->get_pass_by_reference())
-          alloca = Builder.CreateLoad(alloca);
+        Value* alloca = entry_alloca(type, name);
+        compiler->Builder.CreateStore(TheFunction->getArg(i), alloca);
+        compiler->codegen_table.insert_argument(alloca);
 
-        codegen_table.insert_var(name, alloca);
-        
         i++;
       }
     }
 
-    // Retrieve enclosing scope variables
-    Value* next_frame = TheFunction->getArg(0);
-    codegen_table.insert_var("$frame", next_frame);
+    // With bounds checks the lengths of the arrays of unknown size follow, and are arguments like them
+    if (compiler->bounds_check) {
+      for (auto& formal : this->formal_parameters) {
+        if (!formal->get_type()->is(BasicType::IArray))
+          continue;
 
-    int current_depth = this->nesting_level - 1;
-    int variable_position = 1;
+        for (auto& name : formal->get_names()) {
+          Value* alloca = entry_alloca(compiler->i32, name + ".length");
+          compiler->Builder.CreateStore(TheFunction->getArg(i), alloca);
+          compiler->codegen_table.insert_argument(alloca);
 
-    // Start loading variables from previous scopes starting from the innermost
-    // scope and moving outwards
-    for (auto& var : this->prev_scope_vars) {
-      int nesting_level = var->get_nesting_level();
+          i++;
+        }
+      }
+    }
 
-      // Nesting level change so we reset the variable position and move to the next frame
-      if (nesting_level != current_depth) {
-        next_frame = Builder.CreateStructGEP(next_frame, 0);
-        next_frame = Builder.CreateLoad(next_frame);
+    // Retrieve the captured variables starting from the innermost scope and moving outwards
+    if (fun_def->get_frame_type()) {
+      Value* frame = TheFunction->getArg(0);
+      compiler->codegen_table.insert_var("$frame", frame);
+
+      auto owner = fun_def;
+      for (auto& var : fun_def->get_captured_vars())
+        compiler->codegen_table.insert_captured_var(var->get_nesting_level(), var->get_name(),
+                                                    captured_address(frame, owner, var));
+    } else if (compiler->display) {
+      for (auto& var : fun_def->get_captured_vars())
+        compiler->codegen_table.insert_captured_var(var->get_nesting_level(), var->get_name(),
+                                                    display_address(fun_def, var));
+    }
 
-        variable_position = 1;
-      }
+    // The captured variables that are only read follow the arguments and are used instead of
+    // the pointers to them that the frame may also hold for the functions we call
+    for (auto& var : fun_def->get_lifted_vars()) {
+      Value* alloca = entry_alloca(FT->getParamType(i), var->get_name());
+      compiler->Builder.CreateStore(TheFunction->getArg(i), alloca);
 
-      current_depth = nesting_level;
-      
-      Type* type = to_llvm_type(var->get_type());
+      compiler->codegen_table.insert_captured_var(var->get_nesting_level(), var->get_name(), alloca);
+      i++;
+    }
+
+    // Calls in tail position leave the stack of the function behind, so there are none when a pointer
+    // to one of its variables may be kept somewhere, while the references point to the stack of the caller
+    std::set<std::string> escaped = ni.escaped;
+    for (auto& formal : this->formal_parameters)
+      if (formal->get_pass_by_reference())
+        for (auto& name : formal->get_names())
+          escaped.erase(name);
+
+    // The recursive calls in tail position jump back here with new arguments, so the references
+    // are loaded from their allocas after this point
+    if (escaped.empty() && this->body->mark_tail_calls(this->fun_name, true)) {
+      BasicBlock* TailRecursionBB = BasicBlock::Create(*compiler->TheContext, "tail_recursion", TheFunction);
+      compiler->Builder.CreateBr(TailRecursionBB);
+      compiler->Builder.SetInsertPoint(TailRecursionBB);
+
+      compiler->codegen_table.insert_label("$tail_recursion", TailRecursionBB);
+    }
 
-      // Ignore shadowed variables that appear in previous scopes but are hidden due to redeclaration
-      if (!codegen_table.lookup_var(var->get_name())) {
-        Value* v = Builder.CreateStructGEP(next_frame, variable_position);
+    auto arguments = compiler->codegen_table.get_arguments().begin();
+    for (auto& formal : this->formal_parameters) {
+      for (auto& name : formal->get_names()) {
+        Value* v = *arguments++;
 
-        if (!type->isPointerTy())
-          v = Builder.CreateLoad(v);
+        if (formal->get_pass_by_reference())
+          v = compiler->Builder.CreateLoad(v);
 
-        codegen_table.insert_var(var->get_name(), v);
+        compiler->codegen_table.insert_var(name, v);
+        share_variable(name, v);
       }
+    }
 
-      variable_position++;
+    if (compiler->bounds_check)
+      for (auto& formal : this->formal_parameters)
+        if (formal->get_type()->is(BasicType::IArray))
+          for (auto& name : formal->get_names())
+            compiler->codegen_table.insert_var("$length." + name, *arguments++);
+
+    // Only the innermost of the captured variables with the same name is visible, the others
+    // are captured for the functions we call
+    for (auto it = ni.captured.rbegin(); it != ni.captured.rend(); it++) {
+      auto& name = it->first.second;
+      if (!compiler->codegen_table.lookup_var(name))
+        compiler->codegen_table.insert_var(name, compiler->codegen_table.lookup_captured_var(it->first.first, name));
     }
 
     Type* ret_type = FT->getReturnType();
     if (!ret_type->isVoidTy()) {
-      AllocaInst* ret = Builder.CreateAlloca(ret_type, nullptr, "result");
-      codegen_table.insert_var("result", ret);
+      AllocaInst* ret = entry_alloca(ret_type, "result");
+      compiler->codegen_table.insert_var("result", ret);
     } else {
-      codegen_table.insert_var("result", nullptr);
+      compiler->codegen_table.insert_var("result", nullptr);
     }
 
     this->body->codegen();
 
+    close_display_record();
+    free_heap_arrays(compiler->Builder);
+
     // If within procedure then result variable is equal to nullptr
     // else we return its value
-    Value* result_addr = codegen_table.lookup_var("result");
+    Value* result_addr = compiler->codegen_table.lookup_var("result");
     if (result_addr) {
-      Value* result_val = Builder.CreateLoad(result_addr);
-      Builder.CreateRet(result_val);
+      Value* result_val = compiler->Builder.CreateLoad(result_addr);
+      compiler->Builder.CreateRet(result_val);
     } else {
-      Builder.CreateRetVoid();
+      compiler->Builder.CreateRetVoid();
     }
 
-    codegen_table.close_scope();
+    compiler->codegen_table.close_scope();
   }
 
   // Restore builder to parent
-  Builder.SetInsertPoint(Parent);
+  compiler->Builder.SetInsertPoint(Parent);
 
   return nullptr;
 }
 
+// Only a procedure returns right after a call in tail position, a function returns its result
 Value* CallStmt::codegen() {
-  call_codegen(this->fun_name, this->parameters, this->get_line());
+  bool tail = this->tail && compiler->codegen_table.get_current_fun()->get_return_type()->isVoidTy();
+
+  call_codegen(this->fun_name, this->parameters, this->get_line(), tail);
 
   return nullptr;
 }
 
 Value* Return::codegen() {
+  close_display_record();
+  free_heap_arrays(compiler->Builder);
+
   // If within procedure then result variable is equal to nullptr
   // else we return its value
-  Value* result_addr = codegen_table.lookup_var("result");
+  Value* result_addr = compiler->codegen_table.lookup_var("result");
   if (result_addr) {
-    Value* result_val = Builder.CreateLoad(result_addr);
-    Builder.CreateRet(result_val);
+    Value* result_val = compiler->Builder.CreateLoad(result_addr);
+    compiler->Builder.CreateRet(result_val);
   } else {
-    Builder.CreateRetVoid();
+    compiler->Builder.CreateRetVoid();
   }
 
+  after_return();
+
   return nullptr;
 }
 
@@ -2152,34 +3542,42 @@ Value* New::codegen() {
   Value* malloc_size;
   std::vector<Value*> Args;
 
-  Value* l_value = this->l_value->codegen();
+  Value* l_value = this->l_value->codegen_address();
  
   // We use a trick to calculate the element size. By creating a GEP instruction to the nil pointer
   // of the desired type at an offset of 1 we calculate the size of a single element and we cast it
   // to a 64 bit integer
   PointerType* pt = dyn_cast<PointerType>(l_value->getType());
-  Value* nil = ConstantPointerNull::get(dyn_cast<PointerType>(pt->getElementType()));
-  Value* element_size = Builder.CreateGEP(nil, c32(1));
-  malloc_size = Builder.CreatePtrToInt(element_size, Type::getInt64Ty(TheContext));
+
+  // With bounds checks the pointer to an array of unknown size also holds the number of elements
+  StructType* fat = dyn_cast<StructType>(pt->getElementType());
+  PointerType* elements = dyn_cast<PointerType>(fat ? fat->getElementType(0) : pt->getElementType());
+
+  Value* nil = ConstantPointerNull::get(elements);
+  Value* element_size = compiler->Builder.CreateGEP(nil, c32(1));
+  malloc_size = compiler->Builder.CreatePtrToInt(element_size, Type::getInt64Ty(*compiler->TheContext));
 
   // If a size was provided we multiply the element size by the number of elements
+  Value* length = nullptr;
   if (this->size) {
-    Value* size = this->size->codegen();
-    size = (size->getType()->isPointerTy()) ? Builder.CreateLoad(size) : size;
+    length = this->size->codegen_value();
 
-    size = Builder.CreateSExt(size, Type::getInt64Ty(TheContext));
+    Value* size = compiler->Builder.CreateSExt(length, Type::getInt64Ty(*compiler->TheContext));
 
-    malloc_size = Builder.CreateMul(size, malloc_size);
+    malloc_size = compiler->Builder.CreateMul(size, malloc_size);
   }
 
   Args.push_back(malloc_size);
-  Function* malloc = codegen_table.lookup_fun("malloc")->get_function();
-  Value* ptr_to_memory = Builder.CreateCall(malloc, Args);
+  Function* malloc = compiler->codegen_table.lookup_fun("malloc")->get_function();
+  Value* ptr_to_memory = compiler->Builder.CreateCall(malloc, Args);
 
   // Bitcast the result from a pointer to i8 to our type
-  ptr_to_memory = Builder.CreateBitCast(ptr_to_memory, pt->getElementType());
+  ptr_to_memory = compiler->Builder.CreateBitCast(ptr_to_memory, elements);
 
-  Builder.CreateStore(ptr_to_memory, l_value);
+  if (fat)
+    ptr_to_memory = fat_pointer(ptr_to_memory, length);
+
+  compiler->Builder.CreateStore(ptr_to_memory, l_value);
 
   return nullptr;
 }
@@ -2187,88 +3585,219 @@ Value* New::codegen() {
 Value* Dispose::codegen() {
   std::vector<Value*> Args;
 
-  Value* l_value = this->l_value->codegen();
-  Value* ptr = Builder.CreateLoad(l_value);
+  Value* l_value = this->l_value->codegen_address();
+  Value* ptr = compiler->Builder.CreateLoad(l_value);
+  Value* elements = ptr->getType()->isStructTy() ? compiler->Builder.CreateExtractValue(ptr, 0) : ptr;
 
   // Bitcast from our type to pointer to i8
-  Value* ptr_i8 = Builder.CreateBitCast(ptr, i8->getPointerTo());
+  Value* ptr_i8 = compiler->Builder.CreateBitCast(elements, compiler->i8->getPointerTo());
 
   Args.push_back(ptr_i8);
-  Function* free = codegen_table.lookup_fun("free")->get_function();
-  Builder.CreateCall(free, Args);
+  Function* free = compiler->codegen_table.lookup_fun("free")->get_function();
+  compiler->Builder.CreateCall(free, Args);
 
   // Store the nil pointer after the memory is freed
-  Builder.CreateStore(ConstantPointerNull::get(dyn_cast<PointerType>(ptr->getType())), l_value);
+  compiler->Builder.CreateStore(Constant::getNullValue(ptr->getType()), l_value);
 
   return nullptr;
 }
 
+// Assembly and object code go to files named after the input file unless one of the
+// standard output modes or an executable has been requested
+bool Program::file_output() const {
+  return this->exe_name.empty() && !this->asm_output && !this->imm_output &&
+         !(this->obj_output && this->file_name.empty());
+}
+
+// Executables are linked from object code so -o takes precedence over -f
+bool Program::object_output() const {
+  return !this->exe_name.empty() || (!this->asm_output && this->obj_output);
+}
+
+// The llvm IR is printed to standard output instead of assembly or object code
+bool Program::ir_output() const {
+  return this->exe_name.empty() && !this->asm_output && this->imm_output;
+}
+
+// The llvm IR is written to a file next to the assembly or object code as a by-product for inspection
+bool Program::ir_file_output() const {
+  return this->file_output() && this->imm_file;
+}
+
+void Program::write_output(const std::string& code) {
+  if (!this->exe_name.empty()) {
+    // Executable linked against the pcl runtime straight from the object code in memory
+    TimeScope scope(compiler->report.get(), "Linking");
+
+    if (!link_executable(code.data(), code.size(), this->runtime, this->loader, this->exe_name))
+      throw CompileError("Linking failed");
+  } else if (this->file_output()) {
+    write_file(this->file_name + (this->obj_output ? ".o" : ".asm"), code);
+  } else {
+    outs().write(code.data(), code.size());
+  }
+}
+
+void Program::write_ir(const std::string& ir) {
+  if (this->ir_output())
+    outs().write(ir.data(), ir.size());
+  else
+    write_file(this->file_name + ".imm", ir);
+}
+
+// The key covers everything that affects the generated code, with the target resolved
+// the same way as for the target machine so that -march=native entries differ per host
+// The llvm IR is an entry of its own, so that printing it and writing it to a file share it
+bool Program::load_cached(const std::string& source) {
+  if (!this->cache || this->run)
+    return false;
+
+  TimeScope scope(compiler->report.get(), "Cache lookup");
+
+  std::string cpu = this->cpu, features = this->features;
+  resolve_target(cpu, features);
+
+  std::string options = sys::getDefaultTargetTriple() + " -O" + std::to_string(this->opt_level) +
+                        " -mcpu=" + cpu + " -mattr=" + features + (compiler->display ? " display" : "") +
+                        " inline=" + std::to_string(compiler->inline_threshold) +
+                        (compiler->bounds_check ? " bounds-check" : "") +
+                        " max-stack-array=" + std::to_string(compiler->max_stack_array);
+
+  if (this->ir_output() || this->ir_file_output())
+    this->ir_cache_key = this->cache->key(source, options + " ir");
+
+  if (!this->ir_output())
+    this->cache_key = this->cache->key(source, options + (this->object_output() ? " object" : " assembly"));
+
+  std::string ir, code;
+  if (!this->ir_cache_key.empty() && !this->cache->lookup(this->ir_cache_key, ir))
+    return false;
+
+  if (!this->cache_key.empty() && !this->cache->lookup(this->cache_key, code))
+    return false;
+
+  if (!this->ir_cache_key.empty())
+    this->write_ir(ir);
+
+  if (!this->cache_key.empty())
+    this->write_output(code);
+
+  return true;
+}
+
 Value* Program::codegen() {
-  init_module_and_pass_manager(this->optimize);
+  TimeReport* report = compiler->report.get();
+
+  {
+    TimeScope scope(report, "IR generation");
+
+    init_module_and_pass_manager(this->opt_level, this->cpu, this->features);
+
+    FunctionType* FT = FunctionType::get(compiler->i32, false);
+    Function* program = Function::Create(FT, Function::ExternalLinkage, "main", compiler->TheModule.get());
+
+    // Nothing calls main back, which lets the optimizer turn the globals that only main uses into locals
+    program->addFnAttr(Attribute::NoRecurse);
+
+    BasicBlock* BB = BasicBlock::Create(*compiler->TheContext, "entry", program);
+    compiler->Builder.SetInsertPoint(BB);
+
+    compiler->codegen_table.open_scope();
 
-  FunctionType* FT = FunctionType::get(i32, false);
-  Function* program = Function::Create(FT, Function::ExternalLinkage, "main", TheModule.get());
+    codegen_library_functions();
 
-  BasicBlock* BB = BasicBlock::Create(TheContext, "entry", program);
-  Builder.SetInsertPoint(BB);
+    // The program is the parent of the functions declared in it
+    auto& ni = compiler->semantic_to_codegen[""];
+    std::vector<bool> parameters;
+    auto program_def = std::make_shared<FunDef>(compiler->i32, parameters, program, nullptr,
+                                                std::vector<std::shared_ptr<VarInfo>>(), nullptr, ni.nesting_level);
+    program_def->set_shared_vars(ni.shared_vars);
+    compiler->codegen_table.insert_fun("", program_def);
+    compiler->codegen_table.set_current_fun(program_def);
+
+    if (compiler->display) {
+      int depth = 0;
+      for (auto& function : compiler->semantic_to_codegen)
+        depth = std::max(depth, function.second.nesting_level);
+
+      ArrayType* display_type = ArrayType::get(compiler->i8->getPointerTo(), depth + 1);
+      new GlobalVariable(*compiler->TheModule, display_type, false, GlobalValue::InternalLinkage,
+                         ConstantAggregateZero::get(display_type), "pcl.display");
+    }
+
+    open_display_record(program_def);
+
+    this->body->codegen();
 
-  codegen_table.open_scope();
+    compiler->codegen_table.close_scope();
 
-  codegen_library_functions();
+    compiler->Builder.CreateRet(c32(0));
 
-  this->body->codegen();
+    // Tag every function with the target so that the optimizer's cost models and
+    // the code generator agree on the cpu and features we compile for
+    for (auto& F : *compiler->TheModule) {
+      if (F.isDeclaration())
+        continue;
 
-  codegen_table.close_scope();
+      F.addFnAttr("target-cpu", compiler->TheTargetMachine->getTargetCPU());
+      if (!compiler->TheTargetMachine->getTargetFeatureString().empty())
+        F.addFnAttr("target-features", compiler->TheTargetMachine->getTargetFeatureString());
+    }
+  }
 
-  Builder.CreateRet(c32(0));
+  {
+    TimeScope scope(report, "Verification");
 
-  bool invalid = verifyModule(*TheModule, &errs());
-  if (invalid) {
-    std::cerr << "Invalid IR" << std::endl;
-    exit(1);
+    bool invalid = verifyModule(*compiler->TheModule, &errs());
+    if (invalid)
+      throw CompileError("Invalid IR");
   }
  
+  {
+    TimeScope scope(report, "Inlining");
+    inline_functions(*compiler->TheModule, compiler->inline_threshold);
+  }
+
   // Optional optimization
-  if (this->optimize)
-    TheFPM->run(*program);
-
-  std::string imm_name = this->file_name + ".imm";
-  std::string asm_name = this->file_name + ".asm";
-  if (this->asm_output) {
-    // Assembly output to standard output
-    std::error_code EC_IMM;
-    raw_fd_ostream fd_os_imm(imm_name, EC_IMM);
-
-    if (EC_IMM) {
-      errs() << "Error opening output file: " << EC_IMM.message();
-      exit(1);
-    }
+  if (this->opt_level > 0) {
+    TimeScope scope(report, "Optimization");
+    optimize_module(this->opt_level);
+  }
 
-    TheModule->print(fd_os_imm, nullptr);
+  if (this->run) {
+    // Execute the program right away without emitting anything
+    TimeScope scope(report, "Execution");
+    this->exit_code = run_module();
+  } else {
+    // LLVM IR to standard output, or to a file that is only a by-product for inspection and can be skipped
+    if (this->ir_output() || this->ir_file_output()) {
+      TimeScope scope(report, "IR output");
 
-    std::string comm1 = "llc " + imm_name + " -o \"-\"";
-    system(comm1.c_str());
+      std::string ir;
+      raw_string_ostream os(ir);
+      compiler->TheModule->print(os, nullptr);
+      os.flush();
 
-    std::string comm2 = "rm " + imm_name;
-    system(comm2.c_str());
-  } else if (this->imm_output) {
-    // LLVM IR to standard output
-    TheModule->print(outs(), nullptr);
-  } else {
-    // LLVM IR and assembly output to files
-    std::error_code EC_IMM;
-    raw_fd_ostream fd_os_imm(imm_name, EC_IMM);
+      if (!this->ir_cache_key.empty())
+        this->cache->store(this->ir_cache_key, ir);
 
-    if (EC_IMM) {
-      errs() << "Error opening output file: " << EC_IMM.message();
-      exit(1);
+      this->write_ir(ir);
     }
 
-    TheModule->print(fd_os_imm, nullptr);
+    if (!this->ir_output()) {
+      SmallVector<char, 0> buffer;
+      {
+        TimeScope scope(report, "Code emission");
+        emit_code(buffer, this->object_output() ? CGFT_ObjectFile : CGFT_AssemblyFile);
+      }
+
+      std::string code(buffer.begin(), buffer.end());
+      if (!this->cache_key.empty())
+        this->cache->store(this->cache_key, code);
 
-    std::string comm1 = "llc " + imm_name + " -o " + asm_name;
-    system(comm1.c_str());
+      this->write_output(code);
     }
+  }
 
   return nullptr;
 }
@@ -6,6 +6,7 @@
 #include <memory>
 
 namespace llvm {
+  class BasicBlock;
   class Value;
 }
 
@@ -13,7 +14,7 @@ enum class UnOp;
 enum class BinOp;
 
 class TypeInfo;
-class VarInfo;
+class CompileCache;
 
 class Node {
   int line;
@@ -28,6 +29,12 @@ public:
   virtual llvm::Value* codegen() = 0;
 };
 
+// Expressions that denote memory are l-values: variables, array elements, dereferences, result and strings
+// codegen_value: the value of the expression, loaded from its memory if it is an l-value
+// codegen_address: the address of the memory of an l-value and nullptr for any other expression
+// codegen_branch: jump to one of the blocks depending on the value of a boolean expression
+// fold: simplify the subexpressions in place and return a simpler expression to replace this one,
+//       or nullptr to keep it
 class Expr : public Node {
 protected:
   std::shared_ptr<TypeInfo> type;
@@ -36,11 +43,27 @@ public:
   Expr();
 
   std::shared_ptr<TypeInfo> get_type() const;
+
+  virtual std::unique_ptr<Expr> fold();
+
+  llvm::Value* codegen() override;
+  virtual llvm::Value* codegen_value() = 0;
+  virtual llvm::Value* codegen_address();
+  virtual void codegen_branch(llvm::BasicBlock* true_block, llvm::BasicBlock* false_block);
 };
 
+// fold: fold the expressions and simplify the statements in it in place and return a simpler statement
+//       to replace this one, or nullptr to keep it
+// has_label: whether there is a label in the statement, which goto can reach even if the statement is dead
+// mark_tail_calls: mark the calls after which the function returns, given whether it returns right after
+//                  the statement, and return whether one of them calls the function named fun_name
 class Stmt : public Node {
 public:
   Stmt();
+
+  virtual std::unique_ptr<Stmt> fold();
+  virtual bool has_label() const;
+  virtual bool mark_tail_calls(const std::string& fun_name, bool tail);
 };
 
 //------------------------------------------------------------//
@@ -56,9 +79,11 @@ class Boolean : public Expr {
 public:
   Boolean(bool val);
 
+  bool get_val() const;
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
 };
 
 // Name: char
@@ -70,9 +95,11 @@ class Char : public Expr {
 public:
   Char(char val);
 
+  char get_val() const;
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
 };
 
 // Name: integer
@@ -84,9 +111,11 @@ class Integer : public Expr {
 public:
   Integer(int val);
 
+  int get_val() const;
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
 };
 
 // Name: real
@@ -97,9 +126,11 @@ class Real : public Expr {
 public:
   Real(double val);
 
+  double get_val() const;
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
 };
 
 // Type: array[n] of char
@@ -112,7 +143,8 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
+  llvm::Value* codegen_address() override;
 };
 
 // Name: nil
@@ -124,7 +156,7 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
 };
 
 //------------------------------------------------------------//
@@ -138,9 +170,12 @@ class Variable : public Expr {
 public:
   Variable(std::string name);
 
+  std::string get_name() const;
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
+  llvm::Value* codegen_address() override;
 };
 
 // Array expression
@@ -150,21 +185,32 @@ class Array : public Expr {
 public:
   Array(std::unique_ptr<Expr> arr, std::unique_ptr<Expr> index);
 
+  const std::unique_ptr<Expr>& get_array() const;
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  std::unique_ptr<Expr> fold() override;
+  llvm::Value* codegen_value() override;
+  llvm::Value* codegen_address() override;
 };
 
 // Dereference expression
 class Deref : public Expr {
   std::unique_ptr<Expr> ptr;
 
+  // The length that came with a pointer to an array of unknown size with -fbounds-check
+  llvm::Value* length;
+
 public:
   Deref(std::unique_ptr<Expr> ptr);
 
+  llvm::Value* get_length() const;
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  std::unique_ptr<Expr> fold() override;
+  llvm::Value* codegen_value() override;
+  llvm::Value* codegen_address() override;
 };
 
 // Address of variable expression
@@ -176,20 +222,26 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  std::unique_ptr<Expr> fold() override;
+  llvm::Value* codegen_value() override;
 };
 
 // Expr version of a call
 class CallExpr : public Expr {
   std::string fun_name;
   std::vector<std::unique_ptr<Expr>> parameters;
+  bool tail;
 
 public:
   CallExpr(std::string fun_name, std::vector<std::unique_ptr<Expr>> parameters);
 
+  // The function returns the value of the call right after it, returns whether it calls fun_name
+  bool mark_tail_call(const std::string& fun_name);
+
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  std::unique_ptr<Expr> fold() override;
+  llvm::Value* codegen_value() override;
 };
 
 // Result variable for functions
@@ -199,7 +251,8 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  llvm::Value* codegen_value() override;
+  llvm::Value* codegen_address() override;
 };
 
 // Binary expression using arithmetic, comparison or logical operators
@@ -207,12 +260,17 @@ class BinaryExpr : public Expr {
   BinOp op;
   std::unique_ptr<Expr> left, right;
 
+  void codegen_operands(llvm::Value*& left_value, llvm::Value*& right_value);
+  llvm::Value* codegen_comparison(llvm::Value* left_value, llvm::Value* right_value);
+
 public:
   BinaryExpr(BinOp op, std::unique_ptr<Expr> left, std::unique_ptr<Expr> right);
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  std::unique_ptr<Expr> fold() override;
+  llvm::Value* codegen_value() override;
+  void codegen_branch(llvm::BasicBlock* true_block, llvm::BasicBlock* false_block) override;
 };
 
 // Unary operator one of: not, +, -
@@ -225,7 +283,9 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
-  llvm::Value* codegen() override;
+  std::unique_ptr<Expr> fold() override;
+  llvm::Value* codegen_value() override;
+  void codegen_branch(llvm::BasicBlock* true_block, llvm::BasicBlock* false_block) override;
 };
 
 //------------------------------------------------------------//
@@ -257,6 +317,9 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
+  bool has_label() const override;
+  bool mark_tail_calls(const std::string& fun_name, bool tail) override;
   llvm::Value* codegen() override;
 };
 
@@ -306,6 +369,8 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
+  bool mark_tail_calls(const std::string& fun_name, bool tail) override;
   llvm::Value* codegen() override;
 };
 
@@ -331,6 +396,9 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
+  bool has_label() const override;
+  bool mark_tail_calls(const std::string& fun_name, bool tail) override;
   llvm::Value* codegen() override;
 };
 
@@ -344,6 +412,9 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
+  bool has_label() const override;
+  bool mark_tail_calls(const std::string& fun_name, bool tail) override;
   llvm::Value* codegen() override;
 };
 
@@ -357,6 +428,9 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
+  bool has_label() const override;
+  bool mark_tail_calls(const std::string& fun_name, bool tail) override;
   llvm::Value* codegen() override;
 };
 
@@ -390,19 +464,21 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
+  bool mark_tail_calls(const std::string& fun_name, bool tail) override;
   llvm::Value* codegen() override;
 };
 
 // Two types of functions: procedures and functions
 // Procedures don't return a result
 class Fun : public Local {
-  // For each function during the semantic pass we do record keeping for its nesting
-  // level and all the variables that are visible to it from previous scopes
+  // For each function during the semantic pass we do record keeping for its nesting level
   int nesting_level;
-  std::vector<std::shared_ptr<VarInfo>> prev_scope_vars;
 
   // Header
   std::string fun_name;
+  // The names of the enclosing functions and of the function, which tell apart functions of the same name
+  std::string id;
   std::shared_ptr<TypeInfo> return_type;
   std::vector<std::unique_ptr<Formal>> formal_parameters;
 
@@ -418,6 +494,7 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
   llvm::Value* codegen() override;
 };
 
@@ -426,6 +503,7 @@ class CallStmt : public Stmt {
   std::string fun_name;
   std::vector<std::unique_ptr<Expr>> parameters;
   std::vector<bool> pass_by_reference;
+  bool tail;
 
 public:
   CallStmt(std::string fun_name, std::vector<std::unique_ptr<Expr>> parameters);
@@ -433,6 +511,8 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
+  bool mark_tail_calls(const std::string& fun_name, bool tail) override;
   llvm::Value* codegen() override;
 };
 
@@ -455,6 +535,7 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
   llvm::Value* codegen() override;
 };
 
@@ -468,6 +549,7 @@ public:
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
   llvm::Value* codegen() override;
 };
 
@@ -476,18 +558,42 @@ class Program : public Stmt {
   std::string name;
   std::unique_ptr<Body> body;
 
-  std::string file_name;
-  bool optimize, asm_output, imm_output;
+  std::string file_name, exe_name, runtime, loader, cpu, features;
+  int opt_level;
+  bool asm_output, imm_output, obj_output, imm_file, run;
+  int exit_code;
+
+  const CompileCache* cache;
+  std::string cache_key, ir_cache_key;
+
+  bool file_output() const;
+  bool object_output() const;
+  bool ir_output() const;
+  bool ir_file_output() const;
+  void write_output(const std::string& code);
+  void write_ir(const std::string& ir);
 public:
   Program(std::string name, std::unique_ptr<Body> body);
 
   void set_file_name(std::string);
-  void set_optimize(bool optimize);
+  void set_opt_level(int opt_level);
   void set_asm_output(bool asm_output);
   void set_imm_output(bool imm_output);
+  void set_obj_output(bool obj_output);
+  void set_imm_file(bool imm_file);
+  void set_run(bool run);
+  int get_exit_code() const;
+  void set_target(std::string cpu, std::string features);
+  void set_exe_output(std::string exe_name, std::string runtime, std::string loader);
+  void set_cache(const CompileCache* cache);
+
+  // Write out the output stored in the cache for this source and options if there is one
+  // Returns false on a miss, in which case codegen stores its output in the cache
+  bool load_cached(const std::string& source);
 
   void print(std::ostream& out, int level) const override;
   void semantic() override;
+  std::unique_ptr<Stmt> fold() override;
   llvm::Value* codegen() override;
 };
 
@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "cache.hpp"
+
+using namespace llvm;
+
+// A rebuilt compiler may generate different code for the same input, so the version is the size and
+// modification time of the executable along with the llvm release
+// Any file of the compiler that changes is linked into a new executable, unlike a stamp of the build of this file
+static std::string compiler_version() {
+  static const std::string version = [] {
+    std::string executable = sys::fs::getMainExecutable(nullptr, (void*) &compiler_version);
+    std::string version = "pcl " + executable;
+
+    sys::fs::file_status status;
+    if (!sys::fs::status(executable, status))
+      version += " " + std::to_string(status.getSize()) + " " +
+                 std::to_string(sys::toTimeT(status.getLastModificationTime()));
+
+    return version + " llvm " LLVM_VERSION_STRING;
+  }();
+
+  return version;
+}
+
+static const char* stats_name = "stats";
+static const char* stats_lock_name = "stats.lock";
+
+// Entries are named after the hex digest of their key and everything else in the
+// directory (statistics, partially written files) is left alone by eviction
+static bool is_entry(StringRef name) {
+  return name.size() == 40 && std::all_of(name.begin(), name.end(), isHexDigit);
+}
+
+CompileCache::CompileCache(std::string dir, uint64_t max_size)
+  : dir(dir), max_size(max_size) {}
+
+std::string CompileCache::default_dir() {
+  SmallString<128> path;
+  if (!sys::path::cache_directory(path))
+    sys::path::system_temp_directory(true, path);
+
+  sys::path::append(path, "pcl");
+
+  return path.str().str();
+}
+
+std::string CompileCache::entry_path(const std::string& key) const {
+  SmallString<128> path(this->dir);
+  sys::path::append(path, key);
+
+  return path.str().str();
+}
+
+std::string CompileCache::key(const std::string& source, const std::string& options) const {
+  // The parts are separated by a null byte that can't appear in the version or the options
+  std::string data = compiler_version() + '\0' + options + '\0' + source;
+  auto digest = SHA1::hash(ArrayRef<uint8_t>((const uint8_t*) data.data(), data.size()));
+
+  return toHex(digest, true);
+}
+
+bool CompileCache::lookup(const std::string& key, std::string& code) const {
+  std::string path = this->entry_path(key);
+  std::ifstream in(path, std::ios::binary);
+
+  if (!in) {
+    this->update_stats(false, 0);
+    return false;
+  }
+
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  code = buffer.str();
+
+  // Mark the entry as recently used for eviction
+  int fd;
+  if (!sys::fs::openFileForWrite(path, fd, sys::fs::CD_OpenExisting, sys::fs::OF_Append)) {
+    sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+    sys::fs::closeFile(fd);
+  }
+
+  this->update_stats(true, code.size());
+
+  return true;
+}
+
+void CompileCache::store(const std::string& key, const std::string& code) const {
+  if (sys::fs::create_directories(this->dir))
+    return;
+
+  // Write to a unique file first and rename it so that concurrent compilations
+  // never see a partially written entry
+  int fd;
+  SmallString<128> tmp_path;
+  if (sys::fs::createUniqueFile(this->dir + "/tmp-%%%%%%%%", fd, tmp_path))
+    return;
+
+  {
+    raw_fd_ostream os(fd, true);
+    os.write(code.data(), code.size());
+  }
+
+  if (sys::fs::rename(tmp_path, this->entry_path(key))) {
+    sys::fs::remove(tmp_path);
+    return;
+  }
+
+  this->evict();
+}
+
+// Remove the least recently used entries until the cache fits in its size limit
+void CompileCache::evict() const {
+  struct Entry {
+    std::string path;
+    uint64_t size;
+    sys::TimePoint<> time;
+  };
+
+  std::vector<Entry> entries;
+  uint64_t total = 0;
+  std::error_code EC;
+
+  for (sys::fs::directory_iterator it(this->dir, EC), end; it != end && !EC; it.increment(EC)) {
+    if (!is_entry(sys::path::filename(it->path())))
+      continue;
+
+    sys::fs::file_status status;
+    if (sys::fs::status(it->path(), status))
+      continue;
+
+    entries.push_back({it->path(), status.getSize(), status.getLastModificationTime()});
+    total += status.getSize();
+  }
+
+  if (total <= this->max_size)
+    return;
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.time < b.time; });
+
+  for (auto& entry : entries) {
+    if (total <= this->max_size)
+      break;
+
+    if (!sys::fs::remove(entry.path))
+      total -= entry.size;
+  }
+}
+
+// The statistics file holds three counters: hits, misses and bytes served from the cache
+static void read_stats(const std::string& path, uint64_t& hits, uint64_t& misses, uint64_t& bytes) {
+  hits = misses = bytes = 0;
+
+  std::ifstream in(path);
+  in >> hits >> misses >> bytes;
+}
+
+// Concurrent compilations update the statistics one at a time under a lock on a file of their own,
+// and the new counters replace the file with a rename so that print_stats never reads a partial one
+void CompileCache::update_stats(bool hit, uint64_t bytes) const {
+  if (sys::fs::create_directories(this->dir))
+    return;
+
+  int lock = open(this->entry_path(stats_lock_name).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock < 0)
+    return;
+
+  if (flock(lock, LOCK_EX)) {
+    close(lock);
+    return;
+  }
+
+  std::string path = this->entry_path(stats_name);
+
+  uint64_t hits, misses, saved;
+  read_stats(path, hits, misses, saved);
+
+  if (hit) {
+    hits++;
+    saved += bytes;
+  } else {
+    misses++;
+  }
+
+  int fd;
+  SmallString<128> tmp_path;
+  if (!sys::fs::createUniqueFile(this->dir + "/tmp-%%%%%%%%", fd, tmp_path)) {
+    {
+      raw_fd_ostream os(fd, true);
+      os << hits << " " << misses << " " << saved << "\n";
+    }
+
+    if (sys::fs::rename(tmp_path, path))
+      sys::fs::remove(tmp_path);
+  }
+
+  // Closing the file releases the lock
+  close(lock);
+}
+
+void CompileCache::print_stats(std::ostream& out) const {
+  uint64_t hits, misses, saved;
+  read_stats(this->entry_path(stats_name), hits, misses, saved);
+
+  uint64_t entries = 0, size = 0;
+  std::error_code EC;
+
+  for (sys::fs::directory_iterator it(this->dir, EC), end; it != end && !EC; it.increment(EC)) {
+    sys::fs::file_status status;
+    if (is_entry(sys::path::filename(it->path())) && !sys::fs::status(it->path(), status)) {
+      entries++;
+      size += status.getSize();
+    }
+  }
+
+  uint64_t lookups = hits + misses;
+  double hit_rate = lookups ? 100.0 * hits / lookups : 0.0;
+
+  out << "Cache directory: " << this->dir << std::endl
+      << "Entries: " << entries << " (" << size << " of " << this->max_size << " bytes)" << std::endl
+      << "Hits: " << hits << ", misses: " << misses << ", hit rate: "
+      << std::fixed << std::setprecision(1) << hit_rate << "%" << std::endl
+      << "Bytes served from the cache: " << saved << std::endl;
+}
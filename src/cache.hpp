@@ -0,0 +1,35 @@
+#ifndef __CACHE_HPP__
+#define __CACHE_HPP__
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Content addressed on-disk cache of the llvm IR, assembly and object code produced by the compiler
+// Every entry is a file named after the hash of everything that affects the output: the source
+// bytes, the compiler version and the code generation options. The least recently used entries
+// are evicted once the total size of the cache exceeds its limit
+class CompileCache {
+  std::string dir;
+  uint64_t max_size;
+
+  std::string entry_path(const std::string& key) const;
+  void update_stats(bool hit, uint64_t bytes) const;
+  void evict() const;
+public:
+  CompileCache(std::string dir, uint64_t max_size);
+
+  // ~/.cache/pcl or the equivalent directory of the platform
+  static std::string default_dir();
+
+  // Hash of the source and the options string together with the compiler version
+  std::string key(const std::string& source, const std::string& options) const;
+
+  // Fill code with the entry for the key and return true on a hit
+  bool lookup(const std::string& key, std::string& code) const;
+  void store(const std::string& key, const std::string& code) const;
+
+  void print_stats(std::ostream& out) const;
+};
+
+#endif
@@ -15,14 +15,13 @@
 using namespace llvm;
 
 FunDef::FunDef(Type* return_type, std::vector<bool>& parameters, Function* F)
-  : return_type(return_type), parameters(parameters), F(F), lib_fun(true) {}
+  : return_type(return_type), parameters(parameters), F(F), frame_type(nullptr), recursive(false), nesting_level(0),
+    lib_fun(true) {}
 
-FunDef::FunDef(Type* return_type, std::vector<bool>& parameters, Function* F, std::vector<std::shared_ptr<VarInfo>> prev_scope_vars, int nesting_level)
-  : return_type(return_type), parameters(parameters), F(F), prev_scope_vars(prev_scope_vars), nesting_level(nesting_level), lib_fun(false) {}
-
-void FunDef::set_prev_scope_vars(std::vector<std::shared_ptr<VarInfo>>& prev_scope_vars) {
-  this->prev_scope_vars = prev_scope_vars;
-}
+FunDef::FunDef(Type* return_type, std::vector<bool>& parameters, Function* F, std::shared_ptr<FunDef> parent,
+               std::vector<std::shared_ptr<VarInfo>> captured_vars, StructType* frame_type, int nesting_level)
+  : return_type(return_type), parameters(parameters), F(F), parent(parent), captured_vars(captured_vars),
+    frame_type(frame_type), recursive(true), nesting_level(nesting_level), lib_fun(false) {}
 
 Type* FunDef::get_return_type() {
   return this->return_type;
@@ -36,8 +35,48 @@ Function* FunDef::get_function() {
   return this->F;
 }
 
-std::vector<std::shared_ptr<VarInfo>>& FunDef::get_prev_scope_vars() {
-  return this->prev_scope_vars;
+std::shared_ptr<FunDef> FunDef::get_parent() {
+  return this->parent;
+}
+
+std::vector<std::shared_ptr<VarInfo>>& FunDef::get_captured_vars() {
+  return this->captured_vars;
+}
+
+StructType* FunDef::get_frame_type() {
+  return this->frame_type;
+}
+
+void FunDef::set_shared_vars(std::vector<std::shared_ptr<VarInfo>>& shared_vars) {
+  this->shared_vars = shared_vars;
+}
+
+std::vector<std::shared_ptr<VarInfo>>& FunDef::get_shared_vars() {
+  return this->shared_vars;
+}
+
+void FunDef::set_lifted_vars(std::vector<std::shared_ptr<VarInfo>>& lifted_vars) {
+  this->lifted_vars = lifted_vars;
+}
+
+std::vector<std::shared_ptr<VarInfo>>& FunDef::get_lifted_vars() {
+  return this->lifted_vars;
+}
+
+void FunDef::set_open_arrays(std::vector<bool>& open_arrays) {
+  this->open_arrays = open_arrays;
+}
+
+std::vector<bool>& FunDef::get_open_arrays() {
+  return this->open_arrays;
+}
+
+void FunDef::set_recursive(bool recursive) {
+  this->recursive = recursive;
+}
+
+bool FunDef::is_recursive() {
+  return this->recursive;
 }
 
 int FunDef::get_nesting_level() {
@@ -48,10 +87,76 @@ bool FunDef::is_lib_fun() {
   return this->lib_fun;
 }
 
+bool FunDef::has_parent_frame() {
+  for (auto& var : this->captured_vars)
+    if (var->get_nesting_level() < this->nesting_level - 1)
+      return true;
+
+  return false;
+}
+
+std::vector<std::shared_ptr<VarInfo>> FunDef::get_frame_vars() {
+  std::vector<std::shared_ptr<VarInfo>> result;
+
+  for (auto& var : this->captured_vars)
+    if (var->get_nesting_level() == this->nesting_level - 1)
+      result.push_back(var);
+
+  return result;
+}
+
+int FunDef::frame_position(const std::shared_ptr<VarInfo>& var) {
+  int position = this->has_parent_frame() ? 1 : 0;
+
+  for (auto& frame_var : this->get_frame_vars()) {
+    if (frame_var->get_name() == var->get_name() && frame_var->get_nesting_level() == var->get_nesting_level())
+      return position;
+    position++;
+  }
+
+  return -1;
+}
+
+int FunDef::shared_position(const std::string& name) {
+  for (size_t i = 0; i < this->shared_vars.size(); i++)
+    if (this->shared_vars[i]->get_name() == name)
+      return i;
+
+  return -1;
+}
+
+void CodegenScope::set_current_fun(std::shared_ptr<FunDef> fun) {
+  this->current_fun = fun;
+}
+
+std::shared_ptr<FunDef> CodegenScope::get_current_fun() {
+  return this->current_fun;
+}
+
+void CodegenScope::insert_argument(Value* alloca) {
+  this->arguments.push_back(alloca);
+}
+
+std::vector<Value*>& CodegenScope::get_arguments() {
+  return this->arguments;
+}
+
+void CodegenScope::insert_heap_array(Value* memory) {
+  this->heap_arrays.push_back(memory);
+}
+
+std::vector<Value*>& CodegenScope::get_heap_arrays() {
+  return this->heap_arrays;
+}
+
 void CodegenScope::insert_var(std::string name, Value* alloca) {
   this->var_map[name] = alloca;
 }
 
+void CodegenScope::insert_captured_var(int nesting_level, std::string name, Value* address) {
+  this->captured_map[std::make_pair(nesting_level, name)] = address;
+}
+
 void CodegenScope::insert_label(std::string name, BasicBlock* block) {
   this->label_map[name] = block;
 }
@@ -68,6 +173,14 @@ Value* CodegenScope::lookup_var(std::string name) {
     return nullptr;
 }
 
+Value* CodegenScope::lookup_captured_var(int nesting_level, std::string name) {
+  auto it = this->captured_map.find(std::make_pair(nesting_level, name));
+  if (it != this->captured_map.end())
+    return it->second;
+  else
+    return nullptr;
+}
+
 BasicBlock* CodegenScope::lookup_label(std::string name) {
   auto it = this->label_map.find(name);
   if (it != this->label_map.end())
@@ -84,12 +197,6 @@ std::shared_ptr<FunDef> CodegenScope::lookup_fun(std::string name) {
     return nullptr;
 }
 
-std::string CodegenScope::reverse_lookup_fun(Function* F) {
-  for (auto it = std::begin(fun_map); it != std::end(fun_map); it++)
-    if (it->second->get_function() == F)
-      return it->first;
-  return "";
-}
 
 int CodegenTable::get_nesting_level() {
   return this->scopes.size();
@@ -103,10 +210,38 @@ void CodegenTable::close_scope() {
   this->scopes.pop_back();
 }
 
+void CodegenTable::set_current_fun(std::shared_ptr<FunDef> fun) {
+  this->scopes.back().set_current_fun(fun);
+}
+
+std::shared_ptr<FunDef> CodegenTable::get_current_fun() {
+  return this->scopes.back().get_current_fun();
+}
+
+void CodegenTable::insert_argument(Value* alloca) {
+  this->scopes.back().insert_argument(alloca);
+}
+
+std::vector<Value*>& CodegenTable::get_arguments() {
+  return this->scopes.back().get_arguments();
+}
+
+void CodegenTable::insert_heap_array(Value* memory) {
+  this->scopes.back().insert_heap_array(memory);
+}
+
+std::vector<Value*>& CodegenTable::get_heap_arrays() {
+  return this->scopes.back().get_heap_arrays();
+}
+
 void CodegenTable::insert_var(std::string name, Value* alloca) {
   this->scopes.back().insert_var(name, alloca);
 }
 
+void CodegenTable::insert_captured_var(int nesting_level, std::string name, Value* address) {
+  this->scopes.back().insert_captured_var(nesting_level, name, address);
+}
+
 void CodegenTable::insert_label(std::string name, BasicBlock* block) {
   this->scopes.back().insert_label(name, block);
 }
@@ -119,10 +254,26 @@ void CodegenTable::insert_lib_fun(std::string name, std::shared_ptr<FunDef> fun)
   this->lib_fun_map[name] = fun;
 }
 
+void CodegenTable::insert_global_var(std::string name, Value* global) {
+  this->global_var_map[name] = global;
+}
+
 Value* CodegenTable::lookup_var(std::string name) {
   return this->scopes.back().lookup_var(name);
 }
 
+Value* CodegenTable::lookup_captured_var(int nesting_level, std::string name) {
+  return this->scopes.back().lookup_captured_var(nesting_level, name);
+}
+
+Value* CodegenTable::lookup_global_var(std::string name) {
+  auto it = this->global_var_map.find(name);
+  if (it != this->global_var_map.end())
+    return it->second;
+  else
+    return nullptr;
+}
+
 BasicBlock* CodegenTable::lookup_label(std::string name) {
   return this->scopes.back().lookup_label(name);
 }
@@ -144,12 +295,3 @@ std::shared_ptr<FunDef> CodegenTable::lookup_fun(std::string name) {
 std::shared_ptr<FunDef> CodegenTable::current_scope_lookup_fun(std::string name) {
   return this->scopes.back().lookup_fun(name);
 }
-
-std::string CodegenTable::reverse_lookup_fun(Function* F) {
-  for (auto r_it = std::rbegin(this->scopes); r_it != std::rend(this->scopes); r_it++) {
-    auto result = r_it->reverse_lookup_fun(F);
-    if (result != "")
-      return result;
-  }
-  return nullptr;
-}
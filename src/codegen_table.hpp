@@ -10,6 +10,7 @@
 namespace llvm {
   class BasicBlock;
   class Function;
+  class StructType;
   class Type;
   class Value;
 }
@@ -20,29 +21,65 @@ class VarInfo;
 // return_type: the return type of the function or nullptr if void
 // parameters: a vector of bools that denotes whether each variable is passed by reference
 // F: pointer to an llvm Function object
-// prev_scope_vars: a vector that holds basic info about variables that are visible form previous scopes
+// parent: the definition of the function this function is declared in, nullptr for functions of the program
+// captured_vars: the variables of enclosing scopes the function reaches through its frame (or the display),
+//                from the innermost scope outwards
+// frame_type: the struct passed as the first argument, nullptr if the function captures nothing
+//             It holds the frame of the parent if variables of outer scopes are captured, followed by
+//             pointers to the captured variables of the parent
+// shared_vars: the variables of the function that functions declared in it capture, which it publishes
+//              in the display when closures use one
+// lifted_vars: the captured scalars that are only read while the function runs, which are passed by value
+//              after the arguments instead of through the frame
+// open_arrays: whether each parameter is an array of unknown size, whose length is passed after the
+//              arguments when arrays are bounds checked
+// recursive: whether the function can be reentered while it runs, so its variables can't be static
 // nesting_level: the nesting level of the function
 // lib_fun: boool that denotes whether this is a library function or not
 class FunDef {
   llvm::Type* return_type;
   std::vector<bool> parameters;
   llvm::Function* F;
-  std::vector<std::shared_ptr<VarInfo>> prev_scope_vars;
+  std::shared_ptr<FunDef> parent;
+  std::vector<std::shared_ptr<VarInfo>> captured_vars;
+  llvm::StructType* frame_type;
+  std::vector<std::shared_ptr<VarInfo>> shared_vars;
+  std::vector<std::shared_ptr<VarInfo>> lifted_vars;
+  std::vector<bool> open_arrays;
+  bool recursive;
   int nesting_level;
   bool lib_fun;
 
 public:
   FunDef(llvm::Type* return_type, std::vector<bool>& parameters, llvm::Function* F);
-  FunDef(llvm::Type* return_type, std::vector<bool>& parameters, llvm::Function* F, std::vector<std::shared_ptr<VarInfo>> prev_scope_vars, int nesting_level);
-  
-  void set_prev_scope_vars(std::vector<std::shared_ptr<VarInfo>>& prev_scope_vars);
+  FunDef(llvm::Type* return_type, std::vector<bool>& parameters, llvm::Function* F, std::shared_ptr<FunDef> parent,
+         std::vector<std::shared_ptr<VarInfo>> captured_vars, llvm::StructType* frame_type, int nesting_level);
 
   llvm::Type* get_return_type();
   std::vector<bool>& get_parameters();
   llvm::Function* get_function();
-  std::vector<std::shared_ptr<VarInfo>>& get_prev_scope_vars();
+  std::shared_ptr<FunDef> get_parent();
+  std::vector<std::shared_ptr<VarInfo>>& get_captured_vars();
+  llvm::StructType* get_frame_type();
+  void set_shared_vars(std::vector<std::shared_ptr<VarInfo>>& shared_vars);
+  std::vector<std::shared_ptr<VarInfo>>& get_shared_vars();
+  void set_lifted_vars(std::vector<std::shared_ptr<VarInfo>>& lifted_vars);
+  std::vector<std::shared_ptr<VarInfo>>& get_lifted_vars();
+  void set_open_arrays(std::vector<bool>& open_arrays);
+  std::vector<bool>& get_open_arrays();
+  void set_recursive(bool recursive);
+  bool is_recursive();
   int get_nesting_level();
   bool is_lib_fun();
+
+  // Whether the frame starts with the frame of the parent
+  bool has_parent_frame();
+  // The variables of the parent in the frame in the order of their fields
+  std::vector<std::shared_ptr<VarInfo>> get_frame_vars();
+  // The field of the frame that points to the variable or -1 if it's not in the frame
+  int frame_position(const std::shared_ptr<VarInfo>& var);
+  // The field of the display record that points to the variable or -1 if it isn't shared
+  int shared_position(const std::string& name);
 };
 
 // Scope of the codegen table
@@ -50,30 +87,51 @@ public:
 //          or that has the value of the variable itself it is a constant
 // label_map: a hash map that correlates the name of a label to its basic block we can jump to
 // fun_map: a hash map that correlates the name of a function to each definition
+// captured_map: the addresses of the captured variables of the function keyed by nesting level and name,
+//               including the ones that are shadowed and only passed on to the functions it calls
+// current_fun: the definition of the function the scope belongs to, nullptr for the program
+// arguments: the allocas that hold the arguments of the function, in the order of the parameters,
+//            which a recursive call in tail position overwrites before it jumps back to the start
+// heap_arrays: the memory of the local arrays too large for the stack, which is freed before every return
 class CodegenScope {
   std::map<std::string, llvm::Value*> var_map;
+  std::map<std::pair<int, std::string>, llvm::Value*> captured_map;
   std::map<std::string, llvm::BasicBlock*> label_map;
   std::map<std::string, std::shared_ptr<FunDef>> fun_map;
+  std::shared_ptr<FunDef> current_fun;
+  std::vector<llvm::Value*> arguments;
+  std::vector<llvm::Value*> heap_arrays;
 
 public:
+  void set_current_fun(std::shared_ptr<FunDef> fun);
+  std::shared_ptr<FunDef> get_current_fun();
+
+  void insert_argument(llvm::Value* alloca);
+  std::vector<llvm::Value*>& get_arguments();
+
+  void insert_heap_array(llvm::Value* memory);
+  std::vector<llvm::Value*>& get_heap_arrays();
+
   void insert_var(std::string name, llvm::Value* alloca);
+  void insert_captured_var(int nesting_level, std::string name, llvm::Value* address);
   void insert_label(std::string name, llvm::BasicBlock* block);
   void insert_fun(std::string name, std::shared_ptr<FunDef> fun);
 
   llvm::Value* lookup_var(std::string name);
+  llvm::Value* lookup_captured_var(int nesting_level, std::string name);
   llvm::BasicBlock* lookup_label(std::string name);
   std::shared_ptr<FunDef> lookup_fun(std::string name);
-
-  std::string reverse_lookup_fun(llvm::Function* F);
 };
 
 // Codegen table
 // scopes: scopes are implemented by a vector. Each time we enter a deeper scope we push back a scope
 //         and each time we exit one we pop it
 // lib_fun_map: separate map for built in library functions
+// global_var_map: the variables of the program, which are globals visible from every function
 class CodegenTable {
   std::vector<CodegenScope> scopes;
   std::map<std::string, std::shared_ptr<FunDef>> lib_fun_map;
+  std::map<std::string, llvm::Value*> global_var_map;
 
 public:
   int get_nesting_level();
@@ -81,17 +139,31 @@ public:
   void open_scope();
   void close_scope();
 
+  // The function of the innermost scope
+  void set_current_fun(std::shared_ptr<FunDef> fun);
+  std::shared_ptr<FunDef> get_current_fun();
+
+  // The arguments of the function of the innermost scope
+  void insert_argument(llvm::Value* alloca);
+  std::vector<llvm::Value*>& get_arguments();
+
+  // The heap memory of the local arrays of the function of the innermost scope
+  void insert_heap_array(llvm::Value* memory);
+  std::vector<llvm::Value*>& get_heap_arrays();
+
   void insert_var(std::string name, llvm::Value* alloca);
+  void insert_captured_var(int nesting_level, std::string name, llvm::Value* address);
   void insert_label(std::string name, llvm::BasicBlock* block);
   void insert_fun(std::string name, std::shared_ptr<FunDef> fun);
   void insert_lib_fun(std::string name, std::shared_ptr<FunDef> fun);
+  void insert_global_var(std::string name, llvm::Value* global);
 
   llvm::Value* lookup_var(std::string name);
+  llvm::Value* lookup_captured_var(int nesting_level, std::string name);
+  llvm::Value* lookup_global_var(std::string name);
   llvm::BasicBlock* lookup_label(std::string name);
   std::shared_ptr<FunDef> lookup_fun(std::string name);
   std::shared_ptr<FunDef> current_scope_lookup_fun(std::string name);
-
-  std::string reverse_lookup_fun(llvm::Function* F);
 };
 
 #endif
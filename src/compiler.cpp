@@ -0,0 +1,170 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+#include <llvm/Support/TargetSelect.h>
+
+#include "compiler.hpp"
+#include "lexer.hpp"
+#include "types.hpp"
+#include "parser.hpp"
+
+using namespace llvm;
+
+thread_local CompilerInstance* compiler = nullptr;
+
+// The target registry is shared by all compilations and is filled only once
+static std::once_flag targets_initialized;
+
+// Serializes the reports of concurrent compilations on standard error
+static std::mutex report_mutex;
+
+static void initialize_targets() {
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmParsers();
+  InitializeAllAsmPrinters();
+}
+
+CompilerInstance::CompilerInstance()
+  : TheContext(std::make_unique<LLVMContext>()), Builder(*TheContext),
+    i8(Type::getInt8Ty(*TheContext)), i32(Type::getInt32Ty(*TheContext)),
+    f64(Type::getDoubleTy(*TheContext)), line_num(1), display(false), inline_threshold(0),
+    bounds_check(false), max_stack_array(65536) {}
+
+int CompilerInstance::compile(const std::string& file_name, const CompileOptions& options) {
+  std::call_once(targets_initialized, initialize_targets);
+
+  CompilerInstance* previous = compiler;
+  compiler = this;
+  this->display = options.display;
+  this->inline_threshold = options.inline_threshold;
+  this->bounds_check = options.bounds_check;
+  this->max_stack_array = options.max_stack_array;
+
+  if (options.time_report || !options.time_report_json.empty() || !options.time_trace.empty())
+    this->report = std::make_unique<TimeReport>(file_name.empty() ? "<stdin>" : file_name);
+
+  // Read from standard input by default and read from file if a name has been provided
+  FILE* in = stdin;
+  if (!file_name.empty() && !(in = fopen(file_name.c_str(), "r"))) {
+    std::cerr << "Could not open input file " << file_name << std::endl;
+    compiler = previous;
+    return 1;
+  }
+
+  // The cache is keyed by the source bytes so the whole input is read in memory
+  // and the scanner reads it back from there
+  std::string source;
+  if (options.cache) {
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+      source.append(chunk, n);
+
+    if (in != stdin)
+      fclose(in);
+
+    // Older glibc can't open an empty buffer, and an empty temporary file reads the same
+    in = source.empty() ? tmpfile() : fmemopen(&source[0], source.size(), "r");
+    if (!in) {
+      std::cerr << "Could not read input file " << file_name << std::endl;
+      compiler = previous;
+      return 1;
+    }
+  }
+
+  // Parse the input file and emmit code afterwards
+  // An error ends the compilation of this program only, so the scanner and the file are released either way
+  int result;
+  {
+    TimeScope scope(this->report.get(), "Lex and parse");
+
+    yyscan_t scanner;
+    yylex_init_extra(&this->line_num, &scanner);
+    yyset_in(in, scanner);
+
+    try {
+      yy::parser parser(scanner, this->root);
+      result = parser.parse();
+    } catch (const CompileError& e) {
+      std::cerr << e.what() << std::endl;
+      result = 1;
+    }
+
+    yylex_destroy(scanner);
+    if (in != stdin)
+      fclose(in);
+  }
+
+  if (result == 0) {
+    try {
+      root->set_opt_level(options.opt_level);
+      root->set_asm_output(options.asm_output);
+      root->set_imm_output(options.imm_output);
+      root->set_obj_output(options.obj_output);
+      root->set_imm_file(options.imm_file);
+      root->set_run(options.run);
+      root->set_target(options.cpu, options.features);
+      root->set_exe_output(options.exe_name, options.runtime, options.dynamic_linker);
+      root->set_cache(options.cache);
+
+      // Strip file extension
+      if (!file_name.empty()) {
+        size_t index = file_name.find_last_of(".");
+        root->set_file_name(file_name.substr(0, index));
+      }
+
+      // Uncomment the next line to print the AST
+      // root->print(std::cout, 0);
+      if (!root->load_cached(source)) {
+        {
+          TimeScope scope(this->report.get(), "Semantic analysis");
+          root->semantic();
+        }
+
+        {
+          TimeScope scope(this->report.get(), "Constant folding");
+          root->fold();
+        }
+
+        root->codegen();
+      }
+
+      result = root->get_exit_code();
+    } catch (const CompileError& e) {
+      std::cerr << e.what() << std::endl;
+      result = 1;
+    }
+  }
+
+  if (this->report)
+    this->write_report(options);
+
+  compiler = previous;
+
+  return result;
+}
+
+void CompilerInstance::write_report(const CompileOptions& options) const {
+  if (options.time_report) {
+    std::stringstream ss;
+    this->report->print(ss);
+
+    std::lock_guard<std::mutex> lock(report_mutex);
+    std::cerr << ss.str();
+  }
+
+  if (!options.time_report_json.empty()) {
+    std::ofstream out(options.time_report_json);
+    this->report->write_json(out);
+  }
+
+  if (!options.time_trace.empty()) {
+    std::ofstream out(options.time_trace);
+    this->report->write_trace(out);
+  }
+}
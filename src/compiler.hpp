@@ -0,0 +1,148 @@
+#ifndef __COMPILER_HPP__
+#define __COMPILER_HPP__
+
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "ast.hpp"
+#include "codegen_table.hpp"
+#include "symbol_table.hpp"
+#include "time_report.hpp"
+
+class CompileCache;
+
+// Thrown by the scanner and the passes to stop the compilation of the current program
+// CompilerInstance::compile reports the message and fails only that program
+class CompileError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Special struct that doesn't live in a table but is used only to pass
+// info from the semantic pass to the codegen pass
+// parent: the id of the function the function is declared in, empty for functions of the program
+// captured: the variables of enclosing scopes that the function uses, keyed by nesting level and name,
+//           either directly or through the functions it calls and the functions declared in it
+// callees: the ids of the functions called directly from the body of the function, without the library ones
+// written: the captured variables that the function or the functions it calls assign to
+// escaped: the variables of the function that are passed by reference or have their address taken
+// captured_vars: the captured variables reached through the frame, ordered from the innermost scope outwards
+// lifted_vars: the captured scalars that are only read while the function runs, which are passed by value
+// shared_vars: the variables of the function captured through frames by the functions declared in it
+// recursive: whether the function can call itself, directly or through the functions it calls
+// Functions are kept under an id made of their name and the names of the functions they are declared in,
+// as in "/outer/inner", and the program itself under the empty id with nesting level 1
+struct nesting_info {
+  int nesting_level;
+  std::string parent;
+  std::map<std::pair<int, std::string>, std::shared_ptr<VarInfo>> captured;
+  std::set<std::string> callees;
+  std::set<std::pair<int, std::string>> written;
+  std::set<std::string> escaped;
+  std::vector<std::shared_ptr<VarInfo>> captured_vars;
+  std::vector<std::shared_ptr<VarInfo>> lifted_vars;
+  std::vector<std::shared_ptr<VarInfo>> shared_vars;
+  bool recursive = false;
+};
+
+// Options of a compilation as given in the command line
+struct CompileOptions {
+  int opt_level = 0;
+  bool asm_output = false, imm_output = false, obj_output = false, imm_file = true, run = false;
+  std::string cpu, features, exe_name, runtime;
+  const CompileCache* cache = nullptr;
+
+  // Program interpreter of the executables, the one of the C library of the target when empty
+  std::string dynamic_linker;
+
+  // Reach the variables of enclosing scopes through a display instead of the chain of frames
+  bool display = false;
+
+  // Largest cost of the functions inlined at -O0, where the LLVM inliner doesn't run, 0 disables the inliner
+  int inline_threshold = 0;
+
+  // Check the indices of arrays against their length and report the line of the first one out of bounds
+  bool bounds_check = false;
+
+  // Local arrays larger than this many bytes are made static or allocated on the heap instead of the stack
+  unsigned long long max_stack_array = 65536;
+
+  // Print the time report to standard error and/or write it as JSON or as a Chrome trace
+  bool time_report = false;
+  std::string time_report_json, time_trace;
+};
+
+// All the state of a single compilation: the llvm context with everything created in it,
+// the tables of the semantic and codegen passes and the line counter of the scanner
+// Each instance compiles one program at a time so different instances can compile
+// different programs concurrently on different threads
+class CompilerInstance {
+public:
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  // Owns the context once it's shared with the JIT by --run, so that Builder and the types below stay valid
+  llvm::orc::ThreadSafeContext TheJITContext;
+  llvm::IRBuilder<> Builder;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::TargetMachine> TheTargetMachine;
+
+  // Type shortcuts for:
+  // char,bool: i8  (1 byte)
+  // integer:   i32 (4 bytes)
+  // real:      f64 (8 bytes)
+  llvm::Type* i8;
+  llvm::Type* i32;
+  llvm::Type* f64;
+
+  SymbolTable symbol_table;
+  CodegenTable codegen_table;
+  std::map<std::string, nesting_info> semantic_to_codegen;
+  // Ids of the functions whose bodies are being checked by the semantic pass, innermost last
+  std::vector<std::string> function_stack;
+  // Variables that are passed by reference, have their address taken or are references themselves
+  // and may be written through another name, keyed by nesting level and name
+  std::set<std::pair<int, std::string>> escaped_vars;
+
+  // Allocas of the expressions of the statements being generated, whose lifetime ends with them
+  std::vector<llvm::AllocaInst*> temporaries;
+
+  int line_num;
+  std::unique_ptr<Program> root;
+
+  // Closure strategy of the code generator, see CompileOptions
+  bool display;
+
+  // Inlining threshold, see CompileOptions
+  int inline_threshold;
+
+  // Array indices are checked, see CompileOptions
+  bool bounds_check;
+
+  // Largest local array on the stack, see CompileOptions
+  unsigned long long max_stack_array;
+
+  // Time spent in each phase, only when a time report has been requested
+  std::unique_ptr<TimeReport> report;
+
+  CompilerInstance();
+
+  // Parse, check and generate code for the input file, or standard input if the name is empty
+  // Returns the exit code of the compiler (or of the program when it is executed with --run)
+  int compile(const std::string& file_name, const CompileOptions& options);
+
+  void write_report(const CompileOptions& options) const;
+};
+
+// The compilation that runs on the current thread, which the AST passes work on
+extern thread_local CompilerInstance* compiler;
+
+#endif
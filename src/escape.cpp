@@ -0,0 +1,225 @@
+#include <set>
+#include <vector>
+
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+#include "escape.hpp"
+
+using namespace llvm;
+
+// A new whose pointer stays in the function, with the frees of it and the calls it is passed to
+struct Allocation {
+  CallInst* malloc;
+  std::vector<CallInst*> frees;
+  std::vector<CallInst*> calls;
+};
+
+// Follow the pointer returned by malloc through the bitcasts, geps and selects made from it and collect
+// the frees of it and the calls it is passed to, which can no longer be marked tail once it is on the stack
+// Returns false when the pointer escapes: it is stored, returned, converted to an integer, merged by a phi,
+// or passed to a call that may keep it, free it or return a pointer that is used
+static bool stays_local(CallInst* malloc, Function* free, std::vector<CallInst*>& frees,
+                        std::vector<CallInst*>& calls) {
+  std::set<Value*> derived = {malloc};
+  std::vector<Value*> pending = {malloc};
+
+  while (!pending.empty()) {
+    Value* v = pending.back();
+    pending.pop_back();
+
+    for (User* U : v->users()) {
+      auto I = cast<Instruction>(U);
+
+      if (isa<BitCastInst>(I) || isa<GetElementPtrInst>(I) || isa<SelectInst>(I)) {
+        if (derived.insert(I).second)
+          pending.push_back(I);
+      } else if (auto store = dyn_cast<StoreInst>(I)) {
+        if (store->getValueOperand() == v)
+          return false;
+      } else if (auto call = dyn_cast<CallInst>(I)) {
+        if (call->getCalledFunction() == free) {
+          frees.push_back(call);
+          continue;
+        }
+
+        // The callee must neither keep the pointer nor free it, and a pointer it returns may be this one
+        for (unsigned i = 0; i < call->arg_size(); i++)
+          if (call->getArgOperand(i) == v && !call->doesNotCapture(i))
+            return false;
+
+        if (call->isMustTailCall() || !(call->onlyReadsMemory() || call->hasFnAttr(Attribute::NoFree)))
+          return false;
+
+        if (call->getType()->isPointerTy() && !call->use_empty())
+          return false;
+
+        calls.push_back(call);
+      } else if (!isa<LoadInst>(I) && !isa<ICmpInst>(I)) {
+        return false;
+      }
+    }
+  }
+
+  // A select may also choose another pointer, which the free would then free
+  for (Value* v : derived)
+    if (auto select = dyn_cast<SelectInst>(v))
+      for (Value* operand : {select->getTrueValue(), select->getFalseValue()})
+        if (!derived.count(operand) && !isa<ConstantPointerNull>(operand))
+          return false;
+
+  return true;
+}
+
+// Memory of a size only known at run time is taken from the stack and given back after its free, which must
+// run on every path that leaves the malloc before it runs again or the function returns. No other such malloc
+// and no other restore of the stack may run in between, so that the stack is restored in the reverse order
+static bool freed_in_order(CallInst* malloc, CallInst* free, const std::set<CallInst*>& dynamic) {
+  std::set<BasicBlock*> visited;
+  std::vector<BasicBlock::iterator> pending = {std::next(malloc->getIterator())};
+
+  while (!pending.empty()) {
+    BasicBlock::iterator it = pending.back();
+    pending.pop_back();
+
+    BasicBlock* BB = it->getParent();
+    bool freed = false;
+
+    for (; it != BB->end() && !freed; it++) {
+      auto call = dyn_cast<CallInst>(&*it);
+
+      if (call == free)
+        freed = true;
+      else if (call && (call == malloc || dynamic.count(call)))
+        return false;
+      else if (auto intrinsic = dyn_cast<IntrinsicInst>(&*it))
+        if (intrinsic->getIntrinsicID() == Intrinsic::stackrestore)
+          return false;
+    }
+
+    if (freed || isa<UnreachableInst>(BB->getTerminator()))
+      continue;
+
+    if (isa<ReturnInst>(BB->getTerminator()))
+      return false;
+
+    for (BasicBlock* successor : successors(BB))
+      if (visited.insert(successor).second)
+        pending.push_back(successor->begin());
+  }
+
+  return true;
+}
+
+// A constant size becomes an array of bytes in the entry block, which SROA can split into registers
+// A malloc in a loop then reuses the same memory on every iteration. This is only sound because the
+// pointer of one iteration can't reach the next: stays_local rejects the stores and phis that would carry it
+static void allocate_fixed(CallInst* malloc) {
+  uint64_t size = cast<ConstantInt>(malloc->getArgOperand(0))->getZExtValue();
+  BasicBlock& entry = malloc->getFunction()->getEntryBlock();
+  IRBuilder<> builder(&entry, entry.begin());
+
+  AllocaInst* alloca = builder.CreateAlloca(ArrayType::get(builder.getInt8Ty(), size), nullptr, "new");
+  alloca->setAlignment(Align(16));
+
+  malloc->replaceAllUsesWith(builder.CreateBitCast(alloca, malloc->getType()));
+  malloc->eraseFromParent();
+}
+
+// Any other size is allocated on the stack when it is small enough and still on the heap otherwise
+static void allocate_dynamic(CallInst* malloc, CallInst* free, uint64_t max_size) {
+  Module* M = malloc->getModule();
+  Value* size = malloc->getArgOperand(0);
+
+  IRBuilder<> builder(malloc);
+  Value* stack = builder.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::stacksave), {}, "stack");
+  Value* heap = builder.CreateICmpUGT(size, ConstantInt::get(size->getType(), max_size), "heap");
+  Value* stack_size = builder.CreateSelect(heap, ConstantInt::get(size->getType(), 0), size);
+
+  AllocaInst* alloca = builder.CreateAlloca(builder.getInt8Ty(), stack_size, "new");
+  alloca->setAlignment(Align(16));
+
+  // The malloc moves to its own block and the memory is the one of the block that ran
+  BasicBlock* Head = malloc->getParent();
+  Instruction* then = SplitBlockAndInsertIfThen(heap, malloc, false);
+  BasicBlock* Tail = malloc->getParent();
+  malloc->moveBefore(then);
+
+  PHINode* memory = PHINode::Create(malloc->getType(), 2, "memory", &Tail->front());
+  malloc->replaceAllUsesWith(memory);
+  memory->addIncoming(alloca, Head);
+  memory->addIncoming(malloc, then->getParent());
+
+  // Likewise for the free, after which the stack is restored
+  then = SplitBlockAndInsertIfThen(heap, free, false);
+  Tail = free->getParent();
+  free->moveBefore(then);
+
+  builder.SetInsertPoint(&Tail->front());
+  builder.CreateCall(Intrinsic::getDeclaration(M, Intrinsic::stackrestore), {stack});
+}
+
+PreservedAnalyses HeapToStackPass::run(Function& F, FunctionAnalysisManager&) {
+  Module* M = F.getParent();
+  Function* malloc = M->getFunction("malloc_");
+  Function* free = M->getFunction("free");
+  if (!malloc || !free)
+    return PreservedAnalyses::all();
+
+  // Everything is decided before the blocks are split
+  std::vector<Allocation> fixed, dynamic;
+  std::set<CallInst*> candidates;
+
+  for (auto& BB : F) {
+    for (auto& I : BB) {
+      auto call = dyn_cast<CallInst>(&I);
+      if (!call || call->getCalledFunction() != malloc)
+        continue;
+
+      Allocation allocation = {call};
+      if (!stays_local(call, free, allocation.frees, allocation.calls))
+        continue;
+
+      auto size = dyn_cast<ConstantInt>(call->getArgOperand(0));
+      if (size && size->getZExtValue() <= this->max_size) {
+        fixed.push_back(allocation);
+      } else if (!size && allocation.frees.size() == 1) {
+        dynamic.push_back(allocation);
+        candidates.insert(call);
+      }
+    }
+  }
+
+  std::vector<Allocation> ordered;
+  for (auto& allocation : dynamic)
+    if (freed_in_order(allocation.malloc, allocation.frees[0], candidates))
+      ordered.push_back(allocation);
+
+  if (fixed.empty() && ordered.empty())
+    return PreservedAnalyses::all();
+
+  for (auto& allocation : fixed) {
+    for (auto call : allocation.frees)
+      call->eraseFromParent();
+
+    allocate_fixed(allocation.malloc);
+  }
+
+  for (auto& allocation : ordered)
+    allocate_dynamic(allocation.malloc, allocation.frees[0], this->max_size);
+
+  // A call marked tail doesn't reach the stack of its caller
+  for (auto& allocations : {fixed, ordered})
+    for (auto& allocation : allocations)
+      for (auto call : allocation.calls)
+        call->setTailCall(false);
+
+  return PreservedAnalyses::none();
+}
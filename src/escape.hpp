@@ -0,0 +1,22 @@
+#ifndef __ESCAPE_HPP__
+#define __ESCAPE_HPP__
+
+#include <llvm/IR/PassManager.h>
+
+// Move the memory of new to the stack when its pointer never escapes the function: it is only loaded from,
+// stored to, compared and disposed, or passed to calls that neither keep nor free it
+// A constant size of at most max_size bytes becomes an alloca in the entry block, which SROA can then turn
+// into registers, and the dispose is removed
+// A size only known at run time is allocated on the stack when it is at most max_size bytes and on the heap
+// otherwise, when the memory is disposed once in the same loop on every path, and the stack is restored
+// after the dispose
+class HeapToStackPass : public llvm::PassInfoMixin<HeapToStackPass> {
+  unsigned long long max_size;
+
+public:
+  HeapToStackPass(unsigned long long max_size) : max_size(max_size) {}
+
+  llvm::PreservedAnalyses run(llvm::Function& F, llvm::FunctionAnalysisManager& FAM);
+};
+
+#endif
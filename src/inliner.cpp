@@ -0,0 +1,230 @@
+#include <map>
+#include <set>
+#include <vector>
+
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include "inliner.hpp"
+
+using namespace llvm;
+
+// Functions that capture variables take their frame, a pointer to a struct, as the first argument
+static Value* frame_argument(Function& F) {
+  if (F.arg_empty())
+    return nullptr;
+
+  Argument* frame = F.getArg(0);
+  auto pt = dyn_cast<PointerType>(frame->getType());
+
+  return (pt && pt->getElementType()->isStructTy()) ? frame : nullptr;
+}
+
+// A field of a frame is reached through a gep with the indices 0 and the field
+static bool is_field(Value* v, Value* frame, unsigned& field) {
+  auto gep = dyn_cast<GetElementPtrInst>(v);
+  if (!gep || gep->getPointerOperand() != frame || gep->getNumIndices() != 2)
+    return false;
+
+  auto index = dyn_cast<ConstantInt>(gep->getOperand(2));
+  if (!index)
+    return false;
+
+  field = index->getZExtValue();
+  return true;
+}
+
+// The cost of a function is the number of instructions it adds to a caller: the allocas, their lifetime markers
+// and the loads and stores of the local variables go away with mem2reg, and the pointers loaded from the frame
+// are forwarded from the frame the caller builds
+static int cost(Function& F) {
+  Value* frame = frame_argument(F);
+  int cost = 0;
+  unsigned field;
+
+  for (auto& BB : F) {
+    for (auto& I : BB) {
+      if (isa<AllocaInst>(I) || I.isLifetimeStartOrEnd() || is_field(&I, frame, field))
+        continue;
+
+      if (auto store = dyn_cast<StoreInst>(&I))
+        if (isa<AllocaInst>(store->getPointerOperand()))
+          continue;
+
+      if (auto load = dyn_cast<LoadInst>(&I))
+        if (isa<AllocaInst>(load->getPointerOperand()) || is_field(load->getPointerOperand(), frame, field))
+          continue;
+
+      if (isa<BitCastInst>(I) && I.hasOneUse() && cast<Instruction>(*I.user_begin())->isLifetimeStartOrEnd())
+        continue;
+
+      cost++;
+    }
+  }
+
+  return cost;
+}
+
+// Whether a stored value is still the same wherever the store dominates: arguments, constants and allocas never
+// change, and an instruction of the block of the store can't run again without the store running after it
+static bool stays_stored(StoreInst* store) {
+  auto I = dyn_cast<Instruction>(store->getValueOperand());
+
+  return !I || isa<AllocaInst>(I) || I->getParent() == store->getParent();
+}
+
+// A frame is only written while the caller builds it and the callees only read it, so every load of a field
+// that has a single store is replaced by the stored value where the store dominates it
+// The frame is removed when nothing but its stores and lifetime markers is left
+static void forward_frame(AllocaInst* frame, DominatorTree& DT) {
+  std::map<unsigned, std::vector<StoreInst*>> stores;
+  std::vector<std::pair<LoadInst*, unsigned>> loads;
+  bool escapes = false;
+
+  for (User* U : frame->users()) {
+    unsigned field;
+
+    if (is_field(U, frame, field)) {
+      for (User* V : U->users()) {
+        auto store = dyn_cast<StoreInst>(V);
+        auto load = dyn_cast<LoadInst>(V);
+
+        if (store && store->getPointerOperand() == U)
+          stores[field].push_back(store);
+        else if (load)
+          loads.push_back(std::make_pair(load, field));
+        else
+          return;
+      }
+    } else if (isa<BitCastInst>(U)) {
+      for (User* V : U->users())
+        if (!cast<Instruction>(V)->isLifetimeStartOrEnd())
+          return;
+    } else if (isa<CallInst>(U) || isa<StoreInst>(U)) {
+      // Passed to a function we didn't inline or stored as the parent of a deeper frame, which are only read
+      if (auto store = dyn_cast<StoreInst>(U))
+        if (store->getPointerOperand() == frame)
+          return;
+
+      escapes = true;
+    } else {
+      return;
+    }
+  }
+
+  bool used = escapes;
+  for (auto& load : loads) {
+    auto& field_stores = stores[load.second];
+
+    if (field_stores.size() == 1 && DT.dominates(field_stores[0], load.first) && stays_stored(field_stores[0])) {
+      load.first->replaceAllUsesWith(field_stores[0]->getValueOperand());
+      load.first->eraseFromParent();
+    } else {
+      used = true;
+    }
+  }
+
+  if (used)
+    return;
+
+  std::vector<Instruction*> dead;
+  for (User* U : frame->users()) {
+    for (User* V : U->users())
+      dead.push_back(cast<Instruction>(V));
+
+    dead.push_back(cast<Instruction>(U));
+  }
+
+  for (auto I : dead)
+    I->eraseFromParent();
+
+  frame->eraseFromParent();
+}
+
+// Only the frames built for the calls that were inlined are forwarded, the others are still read by their callee
+static void forward_frames(Function& F, const std::set<AllocaInst*>& frames) {
+  DominatorTree DT(F);
+
+  for (auto frame : frames)
+    forward_frame(frame, DT);
+}
+
+void inline_functions(Module& module, int threshold) {
+  if (threshold <= 0)
+    return;
+
+  // The strongly connected components of the call graph come callees first, and the functions
+  // of a component with more than one function or that calls itself are recursive
+  std::vector<Function*> order;
+  std::set<Function*> recursive;
+  {
+    CallGraph CG(module);
+
+    for (auto it = scc_begin(&CG); !it.isAtEnd(); ++it) {
+      const std::vector<CallGraphNode*>& scc = *it;
+
+      for (CallGraphNode* node : scc) {
+        Function* F = node->getFunction();
+        if (!F || F->isDeclaration())
+          continue;
+
+        order.push_back(F);
+
+        if (scc.size() > 1)
+          recursive.insert(F);
+
+        for (auto& call : *node)
+          if (call.second == node)
+            recursive.insert(F);
+      }
+    }
+  }
+
+  // The cost of a callee is taken once everything has been inlined into it
+  std::map<Function*, int> costs;
+  auto inlined = [&](Function* callee) {
+    if (!costs.count(callee))
+      costs[callee] = cost(*callee);
+
+    return costs[callee] <= threshold;
+  };
+
+  // Only the functions of the program can be inlined and they are private, unlike main and the library
+  for (Function* F : order) {
+    std::vector<CallInst*> calls;
+
+    for (auto& BB : *F) {
+      for (auto& I : BB) {
+        auto call = dyn_cast<CallInst>(&I);
+        Function* callee = call ? call->getCalledFunction() : nullptr;
+
+        if (callee && !callee->isDeclaration() && callee->hasPrivateLinkage() && !recursive.count(callee) &&
+            !call->isMustTailCall() && inlined(callee))
+          calls.push_back(call);
+      }
+    }
+
+    // The call is gone once inlined, so its frame is taken before
+    std::set<AllocaInst*> frames;
+    for (auto call : calls) {
+      auto frame = frame_argument(*call->getCalledFunction()) ? dyn_cast<AllocaInst>(call->getArgOperand(0)) : nullptr;
+
+      InlineFunctionInfo info;
+      if (InlineFunction(call, info) && frame)
+        frames.insert(frame);
+    }
+
+    if (!frames.empty())
+      forward_frames(*F, frames);
+  }
+
+  for (Function* F : order)
+    if (F->hasPrivateLinkage() && F->use_empty())
+      F->eraseFromParent();
+}
@@ -0,0 +1,16 @@
+#ifndef __INLINER_HPP__
+#define __INLINER_HPP__
+
+namespace llvm {
+  class Module;
+}
+
+// Inline the calls to the small functions of a program that aren't recursive, the innermost callees first,
+// and forward the pointers stored in the frames built for the inlined calls to the loads of the inlined
+// bodies so that they use the variables of the caller directly. Frames nothing reads anymore are removed
+// and so are the functions that are no longer called
+// threshold: the largest cost of a function that is inlined, 0 disables inlining
+// Only used without optimizations, since the LLVM inliner does better on the functions it would leave
+void inline_functions(llvm::Module& module, int threshold);
+
+#endif
@@ -1,6 +1,15 @@
 #ifndef __LEXER_HPP__
 #define __LEXER_HPP__
 
-extern int line_num;
+#include <cstdio>
+
+// The scanner is reentrant and all of its state lives in a yyscan_t object
+// The extra data of the scanner points to the line counter of the compilation
+typedef void* yyscan_t;
+
+int yylex_init_extra(int* line_num, yyscan_t* scanner);
+int yylex_destroy(yyscan_t scanner);
+void yyset_in(FILE* in, yyscan_t scanner);
+int* yyget_extra(yyscan_t scanner);
 
 #endif
@@ -124,3 +124,14 @@ int8_t* malloc_(int64_t size) {
 
   return ret;
 }
+
+// Called by programs compiled with -fbounds-check, the size is INT32_MAX when it isn't known
+void bounds_error(int32_t line, int32_t index, int32_t size) {
+  fflush(stdout);
+  if (size == INT32_MAX)
+    fprintf(stderr, "Line: %d Error: Array index %d out of bounds\n", line, index);
+  else
+    fprintf(stderr, "Line: %d Error: Array index %d out of bounds for length %d\n", line, index, size);
+
+  exit(1);
+}
@@ -0,0 +1,224 @@
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Triple.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/VersionTuple.h>
+#include <llvm/Support/raw_ostream.h>
+
+// When the lld libraries are installed the Makefile links the lld ELF driver into the compiler
+// and executables are produced without starting any other process. Otherwise the same
+// arguments are handed to the system linker
+#ifdef PCL_LLD
+#include <lld/Common/Driver.h>
+#endif
+
+#include "linker.hpp"
+
+using namespace llvm;
+
+// Directories searched for the C start files and libraries
+static std::vector<std::string> library_dirs(const Triple& triple) {
+  std::string multiarch = triple.getArchName().str() + "-linux-gnu";
+
+  return std::vector<std::string>{"/usr/lib/" + multiarch, "/lib/" + multiarch,
+                                  "/usr/lib64", "/lib64", "/usr/lib", "/lib"};
+}
+
+// crtbegin.o, crtend.o and libgcc come with the gcc installation, which the cc driver finds by taking the
+// highest version under /usr/lib/gcc/<triple>
+static std::string gcc_install_dir(const Triple& triple) {
+  std::string best;
+  VersionTuple best_version;
+
+  for (auto name : {triple.getArchName().str() + "-linux-gnu", triple.str()}) {
+    std::error_code EC;
+    for (sys::fs::directory_iterator it("/usr/lib/gcc/" + name, EC), end; it != end && !EC; it.increment(EC)) {
+      VersionTuple version;
+      if (version.tryParse(sys::path::filename(it->path())) || version <= best_version)
+        continue;
+
+      best = it->path();
+      best_version = version;
+    }
+  }
+
+  return best;
+}
+
+// The program interpreter of the C library of the target, the same one the cc driver passes to the linker
+// Returns an empty string for the targets without a known default
+static std::string dynamic_linker(const Triple& triple) {
+  bool hard_float = triple.getEnvironment() == Triple::GNUEABIHF || triple.getEnvironment() == Triple::MuslEABIHF;
+
+  if (triple.isMusl()) {
+    std::string arch = triple.getArchName().str();
+    if (triple.getArch() == Triple::x86)
+      arch = "i386";
+    else if (triple.getArch() == Triple::arm || triple.getArch() == Triple::thumb)
+      arch = hard_float ? "armhf" : "arm";
+
+    return "/lib/ld-musl-" + arch + ".so.1";
+  }
+
+  switch (triple.getArch()) {
+    case Triple::x86:
+      return "/lib/ld-linux.so.2";
+    case Triple::x86_64:
+      return triple.getEnvironment() == Triple::GNUX32 ? "/libx32/ld-linux-x32.so.2" : "/lib64/ld-linux-x86-64.so.2";
+    case Triple::aarch64:
+      return "/lib/ld-linux-aarch64.so.1";
+    case Triple::aarch64_be:
+      return "/lib/ld-linux-aarch64_be.so.1";
+    case Triple::arm:
+    case Triple::armeb:
+    case Triple::thumb:
+    case Triple::thumbeb:
+      return hard_float ? "/lib/ld-linux-armhf.so.3" : "/lib/ld-linux.so.3";
+    case Triple::ppc:
+      return "/lib/ld.so.1";
+    case Triple::ppc64:
+      return "/lib64/ld64.so.1";
+    case Triple::ppc64le:
+      return "/lib64/ld64.so.2";
+    case Triple::riscv32:
+      return "/lib/ld-linux-riscv32-ilp32d.so.1";
+    case Triple::riscv64:
+      return "/lib/ld-linux-riscv64-lp64d.so.1";
+    case Triple::sparc:
+    case Triple::sparcel:
+      return "/lib/ld-linux.so.2";
+    case Triple::sparcv9:
+      return "/lib64/ld-linux.so.2";
+    case Triple::systemz:
+      return "/lib/ld64.so.1";
+    default:
+      return "";
+  }
+}
+
+static std::string find_file(const std::vector<std::string>& dirs, const std::string& name) {
+  for (auto& dir : dirs) {
+    SmallString<128> path(dir);
+    sys::path::append(path, name);
+
+    if (sys::fs::exists(path))
+      return path.str().str();
+  }
+
+  return "";
+}
+
+// The runtime library is built next to the compiler by the Makefile
+static std::string default_runtime() {
+  std::string exe = sys::fs::getMainExecutable(nullptr, (void*) &default_runtime);
+
+  SmallString<128> path(sys::path::parent_path(exe));
+  sys::path::append(path, "libpcl.a");
+
+  return path.str().str();
+}
+
+bool link_executable(const char* object, size_t size, const std::string& runtime, const std::string& loader,
+                     const std::string& output) {
+  Triple triple(sys::getDefaultTargetTriple());
+
+  if (!triple.isOSLinux()) {
+    errs() << "Linking executables is not supported for target " << triple.str() << "\n";
+    return false;
+  }
+
+  std::string interpreter = loader.empty() ? dynamic_linker(triple) : loader;
+  if (interpreter.empty()) {
+    errs() << "No default dynamic linker for target " << triple.str() << ", give one with --dynamic-linker\n";
+    return false;
+  }
+
+  auto dirs = library_dirs(triple);
+  std::string crt1 = find_file(dirs, "crt1.o");
+  std::string crti = find_file(dirs, "crti.o");
+  std::string crtn = find_file(dirs, "crtn.o");
+
+  std::string gcc_dir = gcc_install_dir(triple);
+  std::string crtbegin = gcc_dir.empty() ? "" : find_file({gcc_dir}, "crtbegin.o");
+  std::string crtend = gcc_dir.empty() ? "" : find_file({gcc_dir}, "crtend.o");
+
+  if (crt1.empty() || crti.empty() || crtn.empty() || crtbegin.empty() || crtend.empty()) {
+    errs() << "Could not find the C runtime start files\n";
+    return false;
+  }
+
+  std::string runtime_lib = runtime.empty() ? default_runtime() : runtime;
+  if (!sys::fs::exists(runtime_lib)) {
+    errs() << "Could not find the pcl runtime library " << runtime_lib << "\n";
+    return false;
+  }
+
+  // The linker reads its inputs from files, so the object code is handed to it as an anonymous file in memory
+  // reached through /proc, which the system linker inherits too, or as a temporary file where there's none
+  std::string object_path;
+  SmallString<128> temporary;
+  int fd = memfd_create("pcl.o", 0);
+
+  if (fd >= 0) {
+    object_path = "/proc/self/fd/" + std::to_string(fd);
+  } else if (auto EC = sys::fs::createTemporaryFile("pcl", "o", fd, temporary)) {
+    errs() << "Error creating temporary file: " << EC.message() << "\n";
+    return false;
+  } else {
+    object_path = temporary.str().str();
+  }
+
+  {
+    raw_fd_ostream os(fd, false);
+    os.write(object, size);
+  }
+
+  std::vector<std::string> args{"ld.lld", "-o", output, "-dynamic-linker", interpreter,
+                                crt1, crti, crtbegin, "-L" + gcc_dir};
+
+  for (auto& dir : dirs)
+    if (sys::fs::is_directory(dir))
+      args.push_back("-L" + dir);
+
+  // The same libraries in the same order as the cc driver
+  args.insert(args.end(), {object_path, runtime_lib, "-lm",
+                           "-lgcc", "--as-needed", "-lgcc_s", "--no-as-needed", "-lc",
+                           "-lgcc", "--as-needed", "-lgcc_s", "--no-as-needed",
+                           crtend, crtn});
+
+  bool success;
+
+#ifdef PCL_LLD
+  std::vector<const char*> lld_args;
+  for (auto& arg : args)
+    lld_args.push_back(arg.c_str());
+
+  success = lld::elf::link(lld_args, false, outs(), errs());
+#else
+  auto ld = sys::findProgramByName("ld");
+  if (!ld) {
+    errs() << "Could not find the system linker\n";
+    success = false;
+  } else {
+    std::vector<StringRef> ld_args(args.begin(), args.end());
+    ld_args[0] = *ld;
+
+    success = sys::ExecuteAndWait(*ld, ld_args) == 0;
+  }
+#endif
+
+  close(fd);
+  if (!temporary.empty())
+    sys::fs::remove(temporary);
+
+  return success;
+}
@@ -0,0 +1,17 @@
+#ifndef __LINKER_HPP__
+#define __LINKER_HPP__
+
+#include <cstddef>
+#include <string>
+
+// Link the object code of a program against the pcl runtime library and the C libraries
+// into an executable
+// object, size: the object code emitted in memory by the code generator
+// runtime: path to libpcl.a or an empty string to use the one next to the compiler executable
+// loader: the dynamic linker the executable is run with or an empty string for the default of the target
+// output: the name of the executable
+// Returns false if linking failed
+bool link_executable(const char* object, size_t size, const std::string& runtime, const std::string& loader,
+                     const std::string& output);
+
+#endif
@@ -8,16 +8,25 @@
 #include "types.hpp"
 #include "parser.hpp"
 
-std::unique_ptr<Program> root;
-extern yy::parser::symbol_type yylex();
+extern yy::parser::symbol_type yylex(yyscan_t scanner);
 %}
 
+%code requires {
+#include <memory>
+
+class Program;
+typedef void* yyscan_t;
+}
+
 %require "3.2"
 %language "c++"
 %define api.value.type variant
 %define api.token.constructor
 %define parse.error verbose
 
+%param       { yyscan_t scanner }
+%parse-param { std::unique_ptr<Program>& root }
+
 %token              ARRAY OF
 %token              DISPOSE NEW CARET AT
 %token              BEGIN_ST DO END_ST IF THEN ELSE WHILE 
@@ -221,5 +230,5 @@ unop:
 %%
 
 void yy::parser::error(const std::string& msg) {
-  std::cerr << "Error: \"" << msg << "\" in line " << line_num << std::endl;
+  std::cerr << "Error: \"" << msg << "\" in line " << *yyget_extra(scanner) << std::endl;
 }
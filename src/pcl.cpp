@@ -1,89 +1,240 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
-#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
 
-#include "ast.hpp"
-#include "parser.hpp"
+#include <unistd.h>
 
-extern FILE *yyin;
-extern std::unique_ptr<Program> root;
+#include "cache.hpp"
+#include "compiler.hpp"
+#include "server.hpp"
 
 static void print_usage (std::string compiler_name) {
-  std::cerr << "Usage: " << compiler_name << " [-O] <input_file> || " << compiler_name << " [-O] [-i|-f]" << std::endl;
+  std::cerr << "Usage: " << compiler_name << " [options] [-c] [--no-imm] [-j <jobs>] <input_file>... || "
+            << compiler_name << " [options] [-i|-f|-c] || "
+            << compiler_name << " [options] -o <output_file> [--runtime <libpcl.a>] [--dynamic-linker <path>] [<input_file>] || "
+            << compiler_name << " [options] --run <input_file>" << std::endl
+            << compiler_name << " --cache-stats [--cache-dir <dir>] || "
+            << compiler_name << " --server <socket>" << std::endl
+            << "Options: -O<level> -march=native -mcpu=<cpu> -mattr=<+feature,-feature,...>" << std::endl
+            << "         --closures=<chain|display> --inline-threshold=<cost> -fbounds-check" << std::endl
+            << "         --max-stack-array=<bytes>" << std::endl
+            << "         --cache [--cache-dir <dir>] [--cache-size <bytes>] [--cache-stats]" << std::endl
+            << "         --time-report [--time-report-json <file>] [--time-trace <file>]" << std::endl
+            << "--run calls main without program arguments, since pcl programs have no access to them" << std::endl;
 }
 
-int main(int argc, char* argv[]) {
-  if (argc < 2 || argc > 3) {
+// A number given on the command line, which must be all digits and fit in 64 bits
+static bool parse_number(const std::string& text, unsigned long long& number) {
+  if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+
+  errno = 0;
+  number = std::strtoull(text.c_str(), nullptr, 10);
+
+  return errno == 0;
+}
+
+// Compile the files on a pool of threads with one compiler instance per file
+// Returns the exit code of the first file that failed or 0
+static int compile_batch(const std::vector<std::string>& file_names, const CompileOptions& options, int jobs) {
+  std::atomic<size_t> next(0);
+  std::vector<int> results(file_names.size(), 0);
+
+  auto worker = [&]() {
+    for (size_t i = next++; i < file_names.size(); i = next++) {
+      CompilerInstance instance;
+      results[i] = instance.compile(file_names[i], options);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::min<int>(jobs, file_names.size()); i++)
+    threads.emplace_back(worker);
+
+  for (auto& thread : threads)
+    thread.join();
+
+  for (int result : results)
+    if (result != 0)
+      return result;
+
+  return 0;
+}
+
+static int compile_command(int argc, char* argv[]) {
+  if (argc < 2) {
     print_usage(argv[0]);
     return 1;
   }
 
-  bool optimize, asm_output, imm_output, input_file;
-  optimize = asm_output = imm_output = input_file = false;
+  CompileOptions options;
+  bool use_cache = false, cache_stats = false;
+  int jobs = 1;
 
-  std::string arg, file_name;
+  std::string arg;
+  std::vector<std::string> file_names;
+  std::string cache_dir = CompileCache::default_dir();
+  unsigned long long cache_size = 256ull << 20;
 
-  if (argc == 2) {
-    arg = std::string(argv[1]);
+  for (int i = 1; i < argc; i++) {
+    arg = std::string(argv[i]);
     if (arg == "-i") {
-      imm_output = true;
+      options.imm_output = true;
     } else if (arg == "-f") {
-      asm_output = true;
-    } else {
-      input_file = true;
-      file_name = arg;
-    }
-  } else if (argc == 3) {
-    arg = std::string(argv[1]);
-    if (arg == "-i") {
-      imm_output = true;
-    } else if (arg == "-f") {
-      asm_output = true;
+      options.asm_output = true;
+    } else if (arg == "-c") {
+      options.obj_output = true;
     } else if (arg == "-O") {
-      optimize = true;
+      options.opt_level = 1;
+    } else if (arg.size() == 3 && arg.substr(0, 2) == "-O" && arg[2] >= '0' && arg[2] <= '3') {
+      options.opt_level = arg[2] - '0';
+    } else if (arg == "--run") {
+      options.run = true;
+    } else if (arg == "--no-imm") {
+      options.imm_file = false;
+    } else if (arg == "-march=native") {
+      options.cpu = "native";
+    } else if (arg.substr(0, 6) == "-mcpu=") {
+      options.cpu = arg.substr(6);
+    } else if (arg.substr(0, 7) == "-mattr=") {
+      options.features = arg.substr(7);
+    } else if (arg == "--closures=chain" || arg == "--closures=display") {
+      options.display = arg == "--closures=display";
+    } else if (arg.substr(0, 19) == "--inline-threshold=" && arg.size() > 19) {
+      unsigned long long threshold;
+      if (!parse_number(arg.substr(19), threshold) || threshold > INT_MAX) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      options.inline_threshold = threshold;
+    } else if (arg == "-fbounds-check") {
+      options.bounds_check = true;
+    } else if (arg.substr(0, 18) == "--max-stack-array=" && arg.size() > 18) {
+      if (!parse_number(arg.substr(18), options.max_stack_array)) {
+        print_usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--cache") {
+      use_cache = true;
+    } else if (arg == "--cache-stats") {
+      cache_stats = true;
+    } else if (arg == "--time-report") {
+      options.time_report = true;
+    } else if ((arg == "-o" || arg == "--runtime" || arg == "--dynamic-linker" || arg == "--cache-dir" ||
+                arg == "--time-report-json" || arg == "--time-trace") && i + 1 < argc) {
+      if (arg == "-o")
+        options.exe_name = std::string(argv[++i]);
+      else if (arg == "--runtime")
+        options.runtime = std::string(argv[++i]);
+      else if (arg == "--dynamic-linker")
+        options.dynamic_linker = std::string(argv[++i]);
+      else if (arg == "--cache-dir")
+        cache_dir = std::string(argv[++i]);
+      else if (arg == "--time-report-json")
+        options.time_report_json = std::string(argv[++i]);
+      else
+        options.time_trace = std::string(argv[++i]);
+    } else if (arg == "--cache-size" && i + 1 < argc) {
+      if (!parse_number(argv[++i], cache_size)) {
+        print_usage(argv[0]);
+        return 1;
+      }
+    } else if ((arg == "-j" && i + 1 < argc) || (arg.size() > 2 && arg.substr(0, 2) == "-j")) {
+      unsigned long long count;
+      if (!parse_number(arg == "-j" ? argv[++i] : arg.substr(2), count) || count < 1 || count > INT_MAX) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      jobs = count;
+    } else if (arg[0] != '-') {
+      file_names.push_back(arg);
     } else {
-      input_file = true;
-      file_name = arg;
-    }
-
-    arg = std::string(argv[2]);
-    if (arg == "-i") {
-      imm_output = true;
-    } else if (arg == "-f") {
-      asm_output = true;
-    } else if (arg == "-O") {
-      optimize = true;
-    } else {
-      input_file = true;
-      file_name = arg;
+      print_usage(argv[0]);
+      return 1;
     }
   }
 
-  // Read from standard input by default and read from file if an argument has been provided
-  if (input_file)
-    yyin = fopen(file_name.c_str(), "r");
+  // When optimizing, inlining before the LLVM inliner only keeps it from inlining the functions left larger
+  if (options.inline_threshold > 0 && options.opt_level > 0) {
+    std::cerr << "Warning: --inline-threshold only applies at -O0 and is ignored" << std::endl;
+    options.inline_threshold = 0;
+  }
 
-  // Parse the input file and emmit code afterwards
-  yy::parser parser;
-  int result = parser.parse();
+  CompileCache cache(cache_dir, cache_size);
+  if (use_cache)
+    options.cache = &cache;
 
-  fclose(yyin);
+  // Only report the statistics when there is nothing to compile
+  if (cache_stats && file_names.empty() && !use_cache) {
+    cache.print_stats(std::cout);
+    return 0;
+  }
 
-  if (result == 0) {
-    root->set_optimize(optimize);
-    root->set_asm_output(asm_output);
-    root->set_imm_output(imm_output);
+  int result;
 
-    // Strip file extension
-    if (input_file) {
-      size_t index = file_name.find_last_of(".");
-      root->set_file_name(file_name.substr(0, index));
+  if (file_names.size() <= 1) {
+    // Read from standard input by default and read from file if an argument has been provided
+    CompilerInstance instance;
+    result = instance.compile(file_names.empty() ? "" : file_names[0], options);
+  } else {
+    // Several inputs are only compiled to files next to each input
+    if (options.imm_output || options.asm_output || options.run || !options.exe_name.empty() ||
+        !options.time_report_json.empty() || !options.time_trace.empty()) {
+      print_usage(argv[0]);
+      return 1;
     }
 
-    // Uncomment the next line to print the AST
-    // root->print(std::cout, 0);
-    root->semantic();
-    root->codegen();
+    result = compile_batch(file_names, options, jobs);
   }
 
+  if (cache_stats)
+    cache.print_stats(std::cerr);
+
   return result;
 }
+
+// Compile a small program once so that the targets are registered and the code of the parser,
+// the passes and the code generator is loaded before the server forks its first request
+static void warm_up() {
+  char dir[] = "/tmp/pcl-XXXXXX";
+  if (!mkdtemp(dir))
+    return;
+
+  std::string name = std::string(dir) + "/warm_up";
+  std::ofstream(name + ".pcl") << "program warm_up;\n"
+                                  "var i, s : integer;\n"
+                                  "begin\n"
+                                  "  i := 0; s := 0;\n"
+                                  "  while i < 10 do begin s := s + i * i; i := i + 1 end;\n"
+                                  "  writeInteger(s)\n"
+                                  "end.\n";
+
+  CompileOptions options;
+  options.opt_level = 2;
+  options.obj_output = true;
+  options.imm_file = false;
+
+  CompilerInstance instance;
+  instance.compile(name + ".pcl", options);
+
+  remove((name + ".pcl").c_str());
+  remove((name + ".o").c_str());
+  rmdir(dir);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 3 && std::string(argv[1]) == "--server") {
+    warm_up();
+    return run_server(argv[2], compile_command);
+  }
+
+  return compile_command(argc, argv);
+}
@@ -0,0 +1,40 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "server.hpp"
+
+// Thin client of the pcl compile server
+// It doesn't link llvm so it starts fast and hands all of its arguments to the server
+
+static void print_usage (std::string client_name) {
+  std::cerr << "Usage: " << client_name << " [--timing] <socket> [pcl arguments]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  int first = 1;
+  bool timing = false;
+
+  if (first < argc && std::string(argv[first]) == "--timing") {
+    timing = true;
+    first++;
+  }
+
+  if (first >= argc) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  ServerReply reply;
+  std::string socket_path(argv[first]);
+
+  if (!run_client(socket_path, argc - first - 1, argv + first + 1, reply))
+    return 1;
+
+  if (timing)
+    fprintf(stderr, "pcl server: wall %.3f ms, user %.3f ms, sys %.3f ms, max rss %lld KB\n",
+            reply.wall_us / 1000.0, reply.user_us / 1000.0, reply.sys_us / 1000.0,
+            (long long) reply.max_rss_kb);
+
+  return reply.status;
+}
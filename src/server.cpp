@@ -0,0 +1,338 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "server.hpp"
+
+// A request is the working directory of the client followed by the arguments of the compiler,
+// each as a 32 bit length and the bytes of the string, preceded by the number of strings.
+// The standard input, output and error of the client travel as ancillary data of the first byte
+
+// Closes a file descriptor when it goes out of scope, so that the early returns on errors don't leak it
+class FileDescriptor {
+  int fd;
+
+public:
+  explicit FileDescriptor(int fd) : fd(fd) {}
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+  ~FileDescriptor() {
+    if (this->fd >= 0)
+      close(this->fd);
+  }
+
+  int get() const {
+    return this->fd;
+  }
+};
+
+static bool write_all(int fd, const void* data, size_t size) {
+  const char* p = (const char*) data;
+
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    p += n;
+    size -= n;
+  }
+
+  return true;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+  char* p = (char*) data;
+
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    p += n;
+    size -= n;
+  }
+
+  return true;
+}
+
+static bool send_request(int fd, const int fds[3], const std::vector<std::string>& strings) {
+  char tag = 'R';
+  iovec iov = {&tag, 1};
+
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+  if (sendmsg(fd, &msg, 0) != 1)
+    return false;
+
+  uint32_t count = strings.size();
+  if (!write_all(fd, &count, sizeof(count)))
+    return false;
+
+  for (auto& str : strings) {
+    uint32_t size = str.size();
+    if (!write_all(fd, &size, sizeof(size)) || !write_all(fd, str.data(), size))
+      return false;
+  }
+
+  return true;
+}
+
+static bool receive_request(int fd, int fds[3], std::vector<std::string>& strings) {
+  char tag;
+  iovec iov = {&tag, 1};
+
+  char control[CMSG_SPACE(3 * sizeof(int))];
+
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(fd, &msg, 0) != 1)
+    return false;
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return false;
+
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+  uint32_t count;
+  if (!read_all(fd, &count, sizeof(count)))
+    return false;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t size;
+    if (!read_all(fd, &size, sizeof(size)))
+      return false;
+
+    std::string str(size, '\0');
+    if (!read_all(fd, &str[0], size))
+      return false;
+
+    strings.push_back(str);
+  }
+
+  return true;
+}
+
+static int64_t microseconds(const timeval& tv) {
+  return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Compile a single request in a child process while watching the connection
+// The client closes the connection (or exits) to cancel the request
+static int handle_request(int conn, Driver driver) {
+  int fds[3];
+  std::vector<std::string> strings;
+
+  if (!receive_request(conn, fds, strings) || strings.empty())
+    return 1;
+
+  timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The compilation holds the only write end of the pipe, so the read end reports
+  // a hang up as soon as the compilation exits
+  int exit_pipe[2];
+  if (pipe(exit_pipe))
+    return 1;
+
+  pid_t pid = fork();
+  if (pid < 0)
+    return 1;
+
+  if (pid == 0) {
+    close(conn);
+    close(exit_pipe[0]);
+
+    for (int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
+    }
+
+    if (chdir(strings[0].c_str())) {
+      std::cerr << "Could not change to directory " << strings[0] << std::endl;
+      exit(1);
+    }
+
+    std::vector<char*> argv{(char*) "pcl"};
+    for (size_t i = 1; i < strings.size(); i++)
+      argv.push_back(&strings[i][0]);
+    argv.push_back(nullptr);
+
+    exit(driver(argv.size() - 1, argv.data()));
+  }
+
+  close(exit_pipe[1]);
+  for (int i = 0; i < 3; i++)
+    close(fds[i]);
+
+  pollfd events[2] = {{conn, POLLIN, 0}, {exit_pipe[0], POLLIN, 0}};
+  while (poll(events, 2, -1) < 0 && errno == EINTR)
+    ;
+
+  int status;
+  rusage usage;
+
+  if (events[1].revents == 0) {
+    kill(pid, SIGKILL);
+    wait4(pid, &status, 0, &usage);
+    return 1;
+  }
+
+  wait4(pid, &status, 0, &usage);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  ServerReply reply;
+  reply.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  reply.wall_us = (int64_t) (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+  reply.user_us = microseconds(usage.ru_utime);
+  reply.sys_us = microseconds(usage.ru_stime);
+  reply.max_rss_kb = usage.ru_maxrss;
+
+  return write_all(conn, &reply, sizeof(reply)) ? 0 : 1;
+}
+
+static std::string server_socket_path;
+
+static void stop_server(int) {
+  unlink(server_socket_path.c_str());
+  _exit(0);
+}
+
+static bool socket_address(const std::string& socket_path, sockaddr_un& addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path is too long: " << socket_path << std::endl;
+    return false;
+  }
+
+  strcpy(addr.sun_path, socket_path.c_str());
+
+  return true;
+}
+
+int run_server(const std::string& socket_path, Driver driver) {
+  sockaddr_un addr;
+  if (!socket_address(socket_path, addr))
+    return 1;
+
+  FileDescriptor listen_socket(socket(AF_UNIX, SOCK_STREAM, 0));
+  int listen_fd = listen_socket.get();
+
+  if (listen_fd < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  // Remove the socket left behind by a previous server
+  unlink(socket_path.c_str());
+
+  if (bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) || listen(listen_fd, SOMAXCONN)) {
+    perror("bind");
+    return 1;
+  }
+
+  server_socket_path = socket_path;
+  signal(SIGINT, stop_server);
+  signal(SIGTERM, stop_server);
+
+  // Request handlers are reaped automatically and a client that went away
+  // is noticed through failed writes
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::cerr << "pcl server listening on " << socket_path << std::endl;
+
+  for (;;) {
+    int conn = accept(listen_fd, nullptr, nullptr);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      perror("accept");
+      return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(listen_fd);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGCHLD, SIG_DFL);
+
+      _exit(handle_request(conn, driver));
+    }
+
+    close(conn);
+  }
+}
+
+bool run_client(const std::string& socket_path, int argc, char* argv[], ServerReply& reply) {
+  sockaddr_un addr;
+  if (!socket_address(socket_path, addr))
+    return false;
+
+  FileDescriptor socket_fd(socket(AF_UNIX, SOCK_STREAM, 0));
+  int fd = socket_fd.get();
+
+  if (fd < 0 || connect(fd, (sockaddr*) &addr, sizeof(addr))) {
+    std::cerr << "Could not connect to the pcl server at " << socket_path << std::endl;
+    return false;
+  }
+
+  char* cwd = getcwd(nullptr, 0);
+  if (!cwd) {
+    perror("getcwd");
+    return false;
+  }
+
+  std::vector<std::string> strings{cwd};
+  free(cwd);
+
+  for (int i = 0; i < argc; i++)
+    strings.push_back(argv[i]);
+
+  const int fds[3] = {0, 1, 2};
+  if (!send_request(fd, fds, strings) || !read_all(fd, &reply, sizeof(reply))) {
+    std::cerr << "The pcl server closed the connection" << std::endl;
+    return false;
+  }
+
+  return true;
+}
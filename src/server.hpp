@@ -0,0 +1,33 @@
+#ifndef __SERVER_HPP__
+#define __SERVER_HPP__
+
+#include <cstdint>
+#include <string>
+
+// Reply of the server to a compilation request
+// status: the exit code of the compiler or 128 + the signal number if it was killed
+// wall_us, user_us, sys_us: wall clock, user and system time of the compilation in microseconds
+// max_rss_kb: peak resident set size of the compilation in kilobytes
+struct ServerReply {
+  int32_t status;
+  int64_t wall_us;
+  int64_t user_us;
+  int64_t sys_us;
+  int64_t max_rss_kb;
+};
+
+// The compiler entry point the server runs for every request with the arguments of the client
+using Driver = int (*)(int argc, char* argv[]);
+
+// Listen on a Unix socket and serve compilation requests until the server is terminated
+// Every request is compiled in a process forked from the server, so it starts with everything
+// the server initialized and an error or a crash of the compilation can't take the server down
+int run_server(const std::string& socket_path, Driver driver);
+
+// Send the arguments to the server listening on the socket and wait for the compilation
+// The standard input, output and error of the client are handed to the server so the compilation
+// reads and writes them directly. If the client goes away before the reply the server
+// cancels the compilation. Returns false if there was no reply from the server
+bool run_client(const std::string& socket_path, int argc, char* argv[], ServerReply& reply);
+
+#endif
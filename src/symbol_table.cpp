@@ -99,17 +99,6 @@ int SymbolTable::get_nesting_level() {
   return this->scopes.size();
 }
 
-std::vector<var_ptr> SymbolTable::get_prev_scope_vars() {
-  std::vector<var_ptr> result;
-
-  for (int i = scopes.size() - 1; i >= 0; i--)
-    for (auto& name : this->scopes[i].get_vars())
-      if (name != "result")
-        result.push_back(std::make_shared<VarInfo>(name, i + 1, this->lookup(name)->get_type()));
-
-  return result;
-}
-
 void SymbolTable::open_scope() {
   this->scopes.push_back(SymbolScope());
 }
@@ -148,6 +137,14 @@ entry_ptr SymbolTable::lookup(std::string name) {
   return nullptr;
 }
 
+int SymbolTable::lookup_nesting_level(std::string name) {
+  for (int i = this->scopes.size() - 1; i >= 0; i--)
+    if (this->scopes[i].lookup(name))
+      return i + 1;
+
+  return 0;
+}
+
 entry_ptr SymbolTable::current_scope_lookup(std::string name) {
   return this->scopes.back().lookup(name);
 }
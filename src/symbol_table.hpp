@@ -88,7 +88,6 @@ class SymbolTable {
 
 public:
   int get_nesting_level();
-  std::vector<std::shared_ptr<VarInfo>> get_prev_scope_vars();
 
   void open_scope();
   void close_scope();
@@ -100,6 +99,8 @@ public:
   void insert_lib_fun(std::string name, std::shared_ptr<Entry> entry);
 
   std::shared_ptr<Entry> lookup(std::string name);
+  // The nesting level of the scope that declares the name or 0 if it is a built in function or not declared
+  int lookup_nesting_level(std::string name);
   std::shared_ptr<Entry> current_scope_lookup(std::string name);
 };
 
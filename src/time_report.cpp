@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <initializer_list>
+#include <iomanip>
+#include <map>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "time_report.hpp"
+
+static int64_t wall_time_us() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+// With -j several compilations share the process so only the cpu time of the thread counts
+static int64_t cpu_time_us() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t peak_rss_kb() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static std::string json_string(const std::string& str) {
+  std::string escaped = "\"";
+
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if ((unsigned char) c < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      escaped += buffer;
+    } else {
+      escaped += c;
+    }
+  }
+
+  return escaped + "\"";
+}
+
+// Pass managers, adaptors and wrappers only run other passes so they are left out of the pass table
+static bool is_container(const std::string& name) {
+  for (auto part : {"PassManager", "Adaptor", "Wrapper", "RepeatedPass"})
+    if (name.find(part) != std::string::npos)
+      return true;
+
+  return false;
+}
+
+struct PassTotal {
+  std::string name;
+  int runs;
+  int64_t wall_us;
+  int64_t cpu_us;
+};
+
+// Optimization passes aggregated by name, slowest first
+static std::vector<PassTotal> pass_totals(const std::vector<PhaseRecord>& phases) {
+  std::map<std::string, PassTotal> totals;
+  std::string phase;
+
+  for (auto& record : phases) {
+    if (record.depth == 0) {
+      phase = record.name;
+      continue;
+    }
+
+    if (phase != "Optimization" || is_container(record.name))
+      continue;
+
+    auto& total = totals.emplace(record.name, PassTotal{record.name, 0, 0, 0}).first->second;
+    total.runs++;
+    total.wall_us += record.wall_us;
+    total.cpu_us += record.cpu_us;
+  }
+
+  std::vector<PassTotal> result;
+  for (auto& total : totals)
+    result.push_back(total.second);
+
+  std::sort(result.begin(), result.end(),
+            [](const PassTotal& a, const PassTotal& b) { return a.wall_us > b.wall_us; });
+
+  return result;
+}
+
+TimeReport::TimeReport(std::string title)
+  : title(title), origin_us(wall_time_us()) {}
+
+void TimeReport::begin(const std::string& name) {
+  int64_t now = wall_time_us();
+
+  this->open_phases.push_back(std::make_pair(this->phases.size(), cpu_time_us()));
+  this->phases.push_back({name, (int) this->open_phases.size() - 1, now - this->origin_us, 0, 0, 0});
+}
+
+void TimeReport::end() {
+  if (this->open_phases.empty())
+    return;
+
+  auto& record = this->phases[this->open_phases.back().first];
+  record.wall_us = wall_time_us() - this->origin_us - record.start_us;
+  record.cpu_us = cpu_time_us() - this->open_phases.back().second;
+  record.peak_rss_kb = peak_rss_kb();
+
+  this->open_phases.pop_back();
+}
+
+void TimeReport::print(std::ostream& out) const {
+  int64_t total_wall = 0, total_cpu = 0;
+
+  out << "===-------------------------------------------------------------------------===" << std::endl
+      << "  Time report for " << this->title << std::endl
+      << "===-------------------------------------------------------------------------===" << std::endl
+      << std::fixed << std::setprecision(3)
+      << std::setw(12) << "Wall (ms)" << std::setw(12) << "CPU (ms)" << std::setw(16) << "Peak RSS (KB)"
+      << "  Phase" << std::endl;
+
+  for (auto& record : this->phases) {
+    if (record.depth != 0)
+      continue;
+
+    total_wall += record.wall_us;
+    total_cpu += record.cpu_us;
+
+    out << std::setw(12) << record.wall_us / 1000.0 << std::setw(12) << record.cpu_us / 1000.0
+        << std::setw(16) << record.peak_rss_kb << "  " << record.name << std::endl;
+  }
+
+  out << std::setw(12) << total_wall / 1000.0 << std::setw(12) << total_cpu / 1000.0
+      << std::setw(16) << peak_rss_kb() << "  Total" << std::endl;
+
+  auto passes = pass_totals(this->phases);
+  if (passes.empty())
+    return;
+
+  out << std::endl
+      << "  Optimization passes" << std::endl
+      << std::setw(12) << "Wall (ms)" << std::setw(12) << "CPU (ms)" << std::setw(16) << "Runs"
+      << "  Pass" << std::endl;
+
+  for (auto& pass : passes)
+    out << std::setw(12) << pass.wall_us / 1000.0 << std::setw(12) << pass.cpu_us / 1000.0
+        << std::setw(16) << pass.runs << "  " << pass.name << std::endl;
+}
+
+void TimeReport::write_json(std::ostream& out) const {
+  out << "{" << std::endl
+      << "  \"title\": " << json_string(this->title) << "," << std::endl
+      << "  \"phases\": [";
+
+  bool first = true;
+  for (auto& record : this->phases) {
+    if (record.depth != 0)
+      continue;
+
+    out << (first ? "" : ",") << std::endl
+        << "    {\"name\": " << json_string(record.name) << ", \"wall_us\": " << record.wall_us
+        << ", \"cpu_us\": " << record.cpu_us << ", \"peak_rss_kb\": " << record.peak_rss_kb << "}";
+    first = false;
+  }
+
+  out << std::endl << "  ]," << std::endl
+      << "  \"passes\": [";
+
+  first = true;
+  for (auto& pass : pass_totals(this->phases)) {
+    out << (first ? "" : ",") << std::endl
+        << "    {\"name\": " << json_string(pass.name) << ", \"runs\": " << pass.runs
+        << ", \"wall_us\": " << pass.wall_us << ", \"cpu_us\": " << pass.cpu_us << "}";
+    first = false;
+  }
+
+  out << std::endl << "  ]," << std::endl
+      << "  \"peak_rss_kb\": " << peak_rss_kb() << std::endl
+      << "}" << std::endl;
+}
+
+void TimeReport::write_trace(std::ostream& out) const {
+  out << "{\"traceEvents\": [";
+
+  bool first = true;
+  for (auto& record : this->phases) {
+    out << (first ? "" : ",") << std::endl
+        << "  {\"name\": " << json_string(record.name) << ", \"cat\": \"pcl\", \"ph\": \"X\""
+        << ", \"ts\": " << record.start_us << ", \"dur\": " << record.wall_us
+        << ", \"pid\": " << getpid() << ", \"tid\": 0"
+        << ", \"args\": {\"cpu_us\": " << record.cpu_us << ", \"peak_rss_kb\": " << record.peak_rss_kb << "}}";
+    first = false;
+  }
+
+  out << std::endl << "], \"displayTimeUnit\": \"ms\"}" << std::endl;
+}
+
+TimeScope::TimeScope(TimeReport* report, const std::string& name)
+  : report(report) {
+  if (this->report)
+    this->report->begin(name);
+}
+
+TimeScope::~TimeScope() {
+  if (this->report)
+    this->report->end();
+}
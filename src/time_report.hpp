@@ -0,0 +1,53 @@
+#ifndef __TIME_REPORT_HPP__
+#define __TIME_REPORT_HPP__
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Wall clock and cpu time of the phases of a compilation
+// Phases nest, e.g. every optimization pass is recorded inside the optimization phase
+// name: the name of the phase or of the pass
+// depth: the number of phases that enclose it
+// start_us: start time in microseconds since the report was created
+// wall_us, cpu_us: wall clock and cpu time of the thread that ran it in microseconds
+// peak_rss_kb: peak resident set size of the compiler process at the end of the phase
+struct PhaseRecord {
+  std::string name;
+  int depth;
+  int64_t start_us;
+  int64_t wall_us;
+  int64_t cpu_us;
+  int64_t peak_rss_kb;
+};
+
+class TimeReport {
+  std::string title;
+  int64_t origin_us;
+  std::vector<PhaseRecord> phases;
+  std::vector<std::pair<size_t, int64_t>> open_phases;
+
+public:
+  TimeReport(std::string title);
+
+  void begin(const std::string& name);
+  void end();
+
+  // Table of the top level phases followed by the optimization passes aggregated by name
+  void print(std::ostream& out) const;
+  void write_json(std::ostream& out) const;
+  // Chrome trace event format that can be loaded in chrome://tracing or Perfetto
+  void write_trace(std::ostream& out) const;
+};
+
+// Record the enclosing scope as a phase of the report, if there is one
+class TimeScope {
+  TimeReport* report;
+
+public:
+  TimeScope(TimeReport* report, const std::string& name);
+  ~TimeScope();
+};
+
+#endif